@@ -1,22 +1,126 @@
 #ifndef MY_MALLOC_H
 #define MY_MALLOC_H
 
-#define ALIGNMENT 8
+// Every block is aligned for any fundamental type, alignof(max_align_t) on x86-64
+#define ALIGNMENT 16
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
-#define MMAP_THRESHOLD (4096)  
-#define IS_MMAP(size) ((size) >= MMAP_THRESHOLD)
+// Requests at or above the mmap threshold get a mapping of their own. The threshold
+// starts at MMAP_THRESHOLD and rises, at most to MMAP_THRESHOLD_MAX, when large
+// blocks of one size are freed and allocated again in quick succession.
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (4096)
+#endif
+#ifndef MMAP_THRESHOLD_MAX
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+#endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 //Function to allocate memory
 void* my_malloc(size_t size);
+//Functions to allocate memory aligned to a power of two. my_posix_memalign returns
+//0, EINVAL for a bad alignment or ENOMEM, my_memalign rounds the alignment up.
+void *my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *my_memalign(size_t alignment, size_t size);
 //Function to make my calloc
 void *my_calloc(size_t nmemb, size_t size);
 //Function to make my realloc
 void *my_realloc(void *ptr, size_t size);
 //Function to free allocated memory
 void my_free(void* ptr);
+// my_free for a caller that knows the size it passed to my_malloc, my_calloc
+// (nmemb * size) or, for a chunk that was resized, the latest my_realloc, whether the
+// chunk moved or not. Like C23 free_sized and sized operator delete; chunks from the
+// aligned allocators must go to my_free. Small sizes go straight to their thread
+// cache bin without a page map lookup. With MALLOCATOR_VALIDATE at 2 or more the
+// size is checked against the chunk first.
+void my_free_sized(void *ptr, size_t size);
+// Bytes the caller may use at ptr, at least the size it asked for. 0 for NULL or a
+// pointer this allocator did not hand out.
+size_t my_malloc_usable_size(void *ptr);
+// Returns free heap memory to the kernel, keeping pad bytes free at the top of each
+// arena. Returns 1 if any memory was released, 0 otherwise.
+int my_malloc_trim(size_t pad);
+// Snapshot of how the allocator holds memory. Walks every free list under the arena
+// locks, so it is meant for tooling and benchmarks rather than frequent polling.
+typedef struct MyHeapInfo {
+    size_t reserved;     // Address space of heap segments, slabs, large and cached mappings
+    size_t committed;    // The part of it backed by memory, before any purging
+    size_t free_bytes;   // Free heap blocks, headers included
+    size_t largest_free; // Payload of the largest free heap block
+} MyHeapInfo;
+void my_heap_info(MyHeapInfo *info);
+// Counters for monitoring, summed over per-thread counters on read. Costs no heap
+// walk and no arena lock, so it is cheap enough to poll every second.
+// Operation counts are kept per power-of-two size class: class 0 up to 16 bytes,
+// class i up to 16 << i bytes, the last class everything larger.
+#define MY_STAT_CLASSES 24
+typedef struct MyMallinfo {
+    size_t allocated;   // Usable bytes of live blocks
+    size_t reserved;    // Address space of heap segments, slabs, large and cached mappings
+    size_t committed;   // The part of it that was committed, purged pages included
+    size_t mapped;      // Bytes in live large mappings
+    size_t mapcache;    // Bytes of freed mappings kept for reuse
+    size_t trimmed;     // Bytes returned by trimming or unmapping heap segments, cumulative
+    size_t purged;      // Bytes of free blocks dropped with MADV_DONTNEED, cumulative
+    size_t heap_allocs; // Served by the heap, slabs or thread caches, cumulative
+    size_t heap_frees;
+    size_t mmap_allocs; // Given a mapping of their own, cumulative
+    size_t mmap_frees;
+    size_t allocs[MY_STAT_CLASSES];
+    size_t frees[MY_STAT_CLASSES];
+} MyMallinfo;
+void my_mallinfo(MyMallinfo *info);
+// Opt-in timing of every malloc, free and realloc, split by the path the call took
+// (thread cache, slab, free list, split, heap growth, mmap, ...). Also switched on by
+// MALLOCATOR_LATENCY=1. my_latency_report fills up to n entries, one per path that
+// has been taken, and returns how many it filled.
+typedef struct MyLatency {
+    const char *path;
+    size_t count;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double p999_ns;
+    double max_ns;
+} MyLatency;
+void my_latency_enable(int on);
+size_t my_latency_report(MyLatency *report, size_t n);
+void print_latency_stats(void);
+// Sampling heap profiler. On average one allocation per `bytes` allocated is sampled
+// along with its call stack, 0 switches sampling off. Also set by
+// MALLOCATOR_PROFILE_RATE. my_profile_dump writes the sampled objects still live, and
+// every stack sampled so far, in the gperftools heap format read by pprof. Returns 0,
+// or -1 with errno set.
+void my_profile_set_rate(size_t bytes);
+int my_profile_dump(const char *path);
+// Allocation tracing. Between my_trace_start and my_trace_stop every my_malloc,
+// my_calloc, my_realloc, my_aligned_alloc (and the memalign calls built on it) and
+// my_free is appended to path: a MyTraceHeader, then MyTraceEvent records in no
+// particular order across threads, to be sorted by time. MALLOCATOR_TRACE=<path>
+// traces from the first allocation. Both return 0, or -1 with errno set; a trace is
+// already running (EBUSY) or none is (EINVAL). Forked children do not trace.
+#define MY_TRACE_MAGIC "MALTRACE"
+#define MY_TRACE_VERSION 1
+enum { MY_TRACE_MALLOC, MY_TRACE_CALLOC, MY_TRACE_REALLOC, MY_TRACE_ALIGNED, MY_TRACE_FREE };
+typedef struct MyTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size; // sizeof(MyTraceEvent)
+} MyTraceHeader;
+typedef struct MyTraceEvent {
+    uint64_t time;   // Nanoseconds since the trace started
+    uint64_t size;   // Bytes requested, per element for calloc, given to my_free_sized or 0
+    uint64_t ptr;    // Address returned or freed, 0 when an allocation failed
+    uint64_t arg;    // realloc: the address passed in, calloc: element count, aligned: alignment
+    uint32_t thread; // Numbered from 1 in the order threads first allocated while tracing
+    uint32_t op;     // MY_TRACE_*
+} MyTraceEvent;
+int my_trace_start(const char *path);
+int my_trace_stop(void);
 // Function to print memory statistics
 void print_memory_stats();
 
@@ -2,7 +2,7 @@
 
 make
 
-valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes ./main
+MALLOCATOR_VALIDATE=3 valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes ./main
 
 
 make clean
\ No newline at end of file
@@ -0,0 +1,412 @@
+// Multithreaded allocator benchmarks, each run once on my_malloc/my_free and once on
+// the system malloc/free:
+//   larson   server churn, random sizes replaced in slot arrays that move between threads
+//   xmalloc  producer/consumer pairs, every block is freed by another thread
+//   scratch  cache-scratch, a small object written repeatedly, sensitive to false sharing
+//   sweep-N  batches of N-byte blocks allocated, touched and freed
+// Usage: ./benchmark [max_threads] [ms_per_run]
+// Every run executes in a forked child so its peak RSS can be read from wait4().
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "my_allocator.h"
+
+#define SAMPLE_EVERY 32       // One operation in this many is timed
+#define MAX_SAMPLES (1 << 16) // Per thread, later samples overwrite the oldest
+#define LARSON_SLOTS 1000
+#define LARSON_ROUND_OPS 10000
+#define XMALLOC_RING 1024
+#define SCRATCH_WRITES 100
+#define SWEEP_BATCH 32
+
+typedef struct Allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void*);
+} Allocator;
+
+static const Allocator allocators[] = {
+    { "mallocator", my_malloc, my_free },
+    { "glibc", malloc, free },
+};
+
+typedef struct Worker {
+    const Allocator *alloc;
+    unsigned id;
+    unsigned nthreads;
+    size_t size;     // Block size for the sweeps
+    void *scratch;   // Object handed over by the main thread for cache-scratch
+    uint64_t ops;
+    uint64_t rng;
+    uint64_t *samples;
+    size_t nsamples;
+    pthread_t thread;
+} Worker;
+
+typedef struct Result {
+    double mops;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+} Result;
+
+static bool stop;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool stopped(void)
+{
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+static uint64_t next_rand(Worker *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static void record(Worker *w, uint64_t ns)
+{
+    w->samples[w->nsamples++ % MAX_SAMPLES] = ns;
+}
+
+static void *timed_malloc(Worker *w, size_t size)
+{
+    if(++w->ops % SAMPLE_EVERY) return w->alloc->malloc(size);
+
+    uint64_t start = now_ns();
+    void *ptr = w->alloc->malloc(size);
+    record(w, now_ns() - start);
+    return ptr;
+}
+
+static void timed_free(Worker *w, void *ptr)
+{
+    if(++w->ops % SAMPLE_EVERY)
+    {
+        w->alloc->free(ptr);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    w->alloc->free(ptr);
+    record(w, now_ns() - start);
+}
+
+                /*LARSON*/
+// Each round a thread works on the slot array of the thread round positions ahead,
+// so blocks are routinely freed by a different thread than the one that allocated them.
+static void **larson_slots;
+static pthread_barrier_t round_barrier;
+static bool round_stop;
+
+static size_t larson_size(Worker *w)
+{
+    return 8 + next_rand(w) % 1000;
+}
+
+static void *larson_worker(void *arg)
+{
+    Worker *w = arg;
+    void **own = larson_slots + (size_t)w->id * LARSON_SLOTS;
+
+    for(size_t i = 0; i < LARSON_SLOTS; i++) own[i] = w->alloc->malloc(larson_size(w));
+    pthread_barrier_wait(&start_barrier);
+
+    unsigned round = 0;
+    for(;;)
+    {
+        void **slots = larson_slots + (size_t)((w->id + round) % w->nthreads) * LARSON_SLOTS;
+        for(unsigned i = 0; i < LARSON_ROUND_OPS; i++)
+        {
+            size_t victim = next_rand(w) % LARSON_SLOTS;
+            timed_free(w, slots[victim]);
+            slots[victim] = timed_malloc(w, larson_size(w));
+        }
+
+        //All threads must agree on the last round before anyone moves to the next array
+        if(pthread_barrier_wait(&round_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) round_stop = stopped();
+        pthread_barrier_wait(&round_barrier);
+        if(round_stop) break;
+        round++;
+    }
+
+    void **slots = larson_slots + (size_t)((w->id + round) % w->nthreads) * LARSON_SLOTS;
+    for(size_t i = 0; i < LARSON_SLOTS; i++) w->alloc->free(slots[i]);
+    return NULL;
+}
+
+                /*XMALLOC*/
+// Even threads produce into a ring, the next odd thread frees what comes out of it.
+// A thread without a partner frees its own blocks in batches.
+typedef struct Ring {
+    void *slots[XMALLOC_RING];
+    size_t head; // Next slot to fill, written by the producer
+    size_t tail; // Next slot to drain, written by the consumer
+    bool done;
+} Ring;
+
+static Ring *rings;
+
+static void *xmalloc_worker(void *arg)
+{
+    Worker *w = arg;
+    Ring *ring = &rings[w->id / 2];
+    bool paired = (w->id | 1) < w->nthreads;
+
+    pthread_barrier_wait(&start_barrier);
+
+    if(!paired)
+    {
+        void *batch[XMALLOC_RING / 4];
+        while(!stopped())
+        {
+            for(size_t i = 0; i < XMALLOC_RING / 4; i++) batch[i] = timed_malloc(w, 16 + next_rand(w) % 112);
+            for(size_t i = 0; i < XMALLOC_RING / 4; i++) timed_free(w, batch[i]);
+        }
+        return NULL;
+    }
+
+    if(w->id % 2 == 0)
+    {
+        while(!stopped())
+        {
+            size_t head = ring->head;
+            if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == XMALLOC_RING)
+            {
+                sched_yield(); // Lets the consumer run when there are fewer cores than threads
+                continue;
+            }
+            ring->slots[head % XMALLOC_RING] = timed_malloc(w, 16 + next_rand(w) % 112);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&ring->done, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    for(;;)
+    {
+        size_t tail = ring->tail;
+        bool done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+        if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            if(done) break;
+            sched_yield();
+            continue;
+        }
+        timed_free(w, ring->slots[tail % XMALLOC_RING]);
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+                /*CACHE-SCRATCH*/
+static void *scratch_worker(void *arg)
+{
+    Worker *w = arg;
+
+    pthread_barrier_wait(&start_barrier);
+    //The first free hands a slot next to other threads' objects to this thread
+    timed_free(w, w->scratch);
+    while(!stopped())
+    {
+        volatile char *obj = timed_malloc(w, 8);
+        for(int i = 0; i < SCRATCH_WRITES; i++) obj[i % 8]++;
+        timed_free(w, (void*)obj);
+    }
+    return NULL;
+}
+
+                /*SIZE SWEEP*/
+static void *sweep_worker(void *arg)
+{
+    Worker *w = arg;
+    void *batch[SWEEP_BATCH];
+
+    pthread_barrier_wait(&start_barrier);
+    while(!stopped())
+    {
+        for(size_t i = 0; i < SWEEP_BATCH; i++)
+        {
+            batch[i] = timed_malloc(w, w->size);
+            *(volatile char*)batch[i] = 1;
+        }
+        for(size_t i = 0; i < SWEEP_BATCH; i++) timed_free(w, batch[i]);
+    }
+    return NULL;
+}
+
+typedef struct Workload {
+    const char *name;
+    void *(*worker)(void*);
+    size_t size;
+} Workload;
+
+static const Workload workloads[] = {
+    { "larson", larson_worker, 0 },
+    { "xmalloc", xmalloc_worker, 0 },
+    { "scratch", scratch_worker, 0 },
+    { "sweep-16", sweep_worker, 16 },
+    { "sweep-64", sweep_worker, 64 },
+    { "sweep-256", sweep_worker, 256 },
+    { "sweep-1K", sweep_worker, 1024 },
+    { "sweep-4K", sweep_worker, 4096 },
+    { "sweep-16K", sweep_worker, 16 * 1024 },
+    { "sweep-64K", sweep_worker, 64 * 1024 },
+    { "sweep-256K", sweep_worker, 256 * 1024 },
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs one workload on nthreads threads for ms milliseconds
+static Result run(const Workload *load, const Allocator *alloc, unsigned nthreads, unsigned ms)
+{
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    Result result = { 0, 0, 0 };
+
+    larson_slots = calloc((size_t)nthreads * LARSON_SLOTS, sizeof(void*));
+    rings = calloc((nthreads + 1) / 2, sizeof(Ring));
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&round_barrier, NULL, nthreads);
+
+    for(unsigned i = 0; i < nthreads; i++)
+    {
+        Worker *w = &workers[i];
+        w->alloc = alloc;
+        w->id = i;
+        w->nthreads = nthreads;
+        w->size = load->size;
+        w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        w->samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        //Allocated back to back by one thread, so neighbouring objects go to different threads
+        if(load->worker == scratch_worker) w->scratch = alloc->malloc(8);
+        pthread_create(&w->thread, NULL, load->worker, w);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    struct timespec pause = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    uint64_t ops = 0;
+    size_t nsamples = 0;
+    for(unsigned i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        nsamples += workers[i].nsamples < MAX_SAMPLES ? workers[i].nsamples : MAX_SAMPLES;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t *samples = malloc((nsamples + 1) * sizeof(uint64_t));
+    size_t n = 0;
+    for(unsigned i = 0; i < nthreads; i++)
+    {
+        size_t kept = workers[i].nsamples < MAX_SAMPLES ? workers[i].nsamples : MAX_SAMPLES;
+        memcpy(samples + n, workers[i].samples, kept * sizeof(uint64_t));
+        n += kept;
+        free(workers[i].samples);
+    }
+    if(n)
+    {
+        qsort(samples, n, sizeof(uint64_t), compare_u64);
+        result.p50_ns = samples[n / 2];
+        result.p99_ns = samples[n * 99 / 100];
+    }
+    result.mops = (double)ops * 1000.0 / (double)elapsed;
+
+    free(samples);
+    free(rings);
+    free(larson_slots);
+    free(workers);
+    return result;
+}
+
+// Forks so that every run starts from a fresh heap and reports its own peak RSS
+static bool run_isolated(const Workload *load, const Allocator *alloc, unsigned nthreads, unsigned ms, Result *result, long *peak_kb)
+{
+    int fds[2];
+    if(pipe(fds)) return false;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) return false;
+    if(pid == 0)
+    {
+        close(fds[0]);
+        Result r = run(load, alloc, nthreads, ms);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) != pid) return false;
+    *peak_kb = usage.ru_maxrss;
+    return got == (ssize_t)sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_threads = argc > 1 ? (unsigned)atoi(argv[1]) : (cpus > 0 ? (unsigned)cpus : 1);
+    unsigned ms = argc > 2 ? (unsigned)atoi(argv[2]) : 300;
+    if(!max_threads) max_threads = 1;
+    if(!ms) ms = 1;
+
+    printf("%-11s %7s  %-10s %9s %8s %8s %10s %9s\n",
+           "workload", "threads", "allocator", "Mops/s", "p50 ns", "p99 ns", "peak RSS", "vs glibc");
+
+    for(size_t l = 0; l < sizeof(workloads) / sizeof(workloads[0]); l++)
+    {
+        for(unsigned threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+        {
+            Result results[2];
+            long peak_kb[2];
+            bool ok[2];
+            for(size_t a = 0; a < 2; a++) ok[a] = run_isolated(&workloads[l], &allocators[a], threads, ms, &results[a], &peak_kb[a]);
+
+            for(size_t a = 0; a < 2; a++)
+            {
+                if(!ok[a])
+                {
+                    printf("%-11s %7u  %-10s   run failed\n", workloads[l].name, threads, allocators[a].name);
+                    continue;
+                }
+                printf("%-11s %7u  %-10s %9.2f %8llu %8llu %7.1f MB",
+                       workloads[l].name, threads, allocators[a].name, results[a].mops,
+                       (unsigned long long)results[a].p50_ns, (unsigned long long)results[a].p99_ns,
+                       peak_kb[a] / 1024.0);
+                //Throughput relative to the system allocator on the same run
+                if(a == 0 && ok[1] && results[1].mops > 0) printf(" %8.2fx", results[0].mops / results[1].mops);
+                printf("\n");
+            }
+            if(threads == max_threads) break;
+        }
+    }
+    return 0;
+}
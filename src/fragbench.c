@@ -0,0 +1,186 @@
+// Long-running fragmentation benchmark. Replays millions of allocate/free steps with
+// mixed lifetimes and a size mix that shifts between phases, and samples RSS and the
+// allocator's own view of the heap as it goes.
+// Usage: ./fragbench [steps] [sample_every] [seed]
+// Placement policies are compared through the tuning variables: size classes
+// (default) against plain best fit with MALLOCATOR_BEST_FIT=1.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include "my_allocator.h"
+
+#define PHASE_STEPS 1000000 // The size mix changes this often
+
+// Objects wait in a min-heap ordered by the step at which they are freed
+typedef struct Live {
+    uint64_t death;
+    void *ptr;
+    size_t size;
+} Live;
+
+static Live *live;
+static size_t live_count;
+static size_t live_capacity;
+static size_t live_bytes;
+static uint64_t rng;
+
+static uint64_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double uniform(void)
+{
+    return (double)(next_rand() >> 11) / (double)(1ULL << 53);
+}
+
+// Log-uniform in [lo, hi), so every power of two in the range is equally common
+static uint64_t log_uniform(uint64_t lo, uint64_t hi)
+{
+    double lg = log((double)lo) + uniform() * (log((double)hi) - log((double)lo));
+    return (uint64_t)exp(lg);
+}
+
+// Most objects die young, a quarter live for a while and a few for most of the run
+static uint64_t draw_lifetime(void)
+{
+    double kind = uniform();
+    if(kind < 0.70) return 1 + (uint64_t)(-100.0 * log(1.0 - uniform()));
+    if(kind < 0.95) return 1 + (uint64_t)(-10000.0 * log(1.0 - uniform()));
+    return log_uniform(100000, 10000000);
+}
+
+// Even phases are dominated by small objects, odd phases by medium ones, and large
+// buffers turn up in both. Blocks freed in one phase rarely fit the next one's sizes.
+static size_t draw_size(uint64_t step)
+{
+    double kind = uniform();
+    bool small_phase = (step / PHASE_STEPS) % 2 == 0;
+
+    if(kind < 0.01) return log_uniform(16 * 1024, 1024 * 1024);
+    if(kind < (small_phase ? 0.85 : 0.25)) return log_uniform(8, 256);
+    return log_uniform(256, 8 * 1024);
+}
+
+static void live_push(Live item)
+{
+    if(live_count == live_capacity)
+    {
+        live_capacity = live_capacity ? live_capacity * 2 : 1024;
+        live = realloc(live, live_capacity * sizeof(Live));
+        if(!live)
+        {
+            fprintf(stderr, "out of memory for the live set\n");
+            exit(1);
+        }
+    }
+
+    size_t i = live_count++;
+    while(i && live[(i - 1) / 2].death > item.death)
+    {
+        live[i] = live[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    live[i] = item;
+}
+
+static Live live_pop(void)
+{
+    Live top = live[0];
+    Live last = live[--live_count];
+    size_t i = 0;
+
+    for(;;)
+    {
+        size_t child = 2 * i + 1;
+        if(child >= live_count) break;
+        if(child + 1 < live_count && live[child + 1].death < live[child].death) child++;
+        if(last.death <= live[child].death) break;
+        live[i] = live[child];
+        i = child;
+    }
+    if(live_count) live[i] = last;
+    return top;
+}
+
+static size_t resident_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0, resident = 0;
+    if(!f) return 0;
+    if(fscanf(f, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void sample(uint64_t step)
+{
+    MyHeapInfo info;
+    my_heap_info(&info);
+    size_t rss = resident_bytes();
+
+    //Free memory that could not serve a request as large as the largest free block
+    double frag = info.free_bytes ? 100.0 * (1.0 - (double)info.largest_free / (double)info.free_bytes) : 0.0;
+    printf("%10llu %9zu %11.1f %11.1f %11.1f %11.1f %10.1f %11.1f %7.1f%% %7.1f%%\n",
+           (unsigned long long)step, live_count, live_bytes / 1048576.0, rss / 1048576.0,
+           info.reserved / 1048576.0, info.committed / 1048576.0, info.free_bytes / 1048576.0,
+           info.largest_free / 1048576.0, frag, rss ? 100.0 * (double)live_bytes / (double)rss : 0.0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t steps = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+    uint64_t every = argc > 2 ? strtoull(argv[2], NULL, 0) : 250000;
+    rng = argc > 3 ? strtoull(argv[3], NULL, 0) : 0x9E3779B97F4A7C15ULL;
+    if(!every) every = steps ? steps : 1;
+    if(!rng) rng = 1;
+
+    printf("%10s %9s %11s %11s %11s %11s %10s %11s %8s %8s\n",
+           "step", "objects", "live MB", "RSS MB", "reserved MB", "commit MB", "free MB", "largest MB", "frag", "eff");
+
+    for(uint64_t step = 0; step < steps; step++)
+    {
+        while(live_count && live[0].death <= step)
+        {
+            Live dead = live_pop();
+            my_free(dead.ptr);
+            live_bytes -= dead.size;
+        }
+
+        size_t size = draw_size(step);
+        void *ptr = my_malloc(size);
+        if(!ptr)
+        {
+            fprintf(stderr, "allocation of %zu bytes failed at step %llu\n", size, (unsigned long long)step);
+            return 1;
+        }
+        memset(ptr, (int)(step & 0xff), size); // Fill it like a caller would, so RSS is honest
+        live_push((Live){ step + draw_lifetime(), ptr, size });
+        live_bytes += size;
+
+        if(step % every == 0) sample(step);
+    }
+    sample(steps);
+
+    //What is left once everything is freed shows how much the allocator hands back
+    while(live_count)
+    {
+        Live dead = live_pop();
+        my_free(dead.ptr);
+        live_bytes -= dead.size;
+    }
+    sample(steps);
+    //Chunks parked in the thread cache keep free neighbours apart until they are flushed
+    my_malloc_trim(0);
+    sample(steps);
+    free(live);
+    return 0;
+}
@@ -4,6 +4,10 @@
 #include <string.h>
 #include "my_allocator.h"
 #include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
 
 #define COLOR_GREEN "\033[0;32m"
 #define COLOR_RED "\033[0;31m"
@@ -226,6 +230,181 @@ void test_coalescing()
     print_memory_stats();
     
     print_test_result(1);
+}
+void test_size_class_reuse() 
+{
+    print_test_header("Size Class Reuse Test");
+
+    #define NUM_LIVE 200
+    void *live[NUM_LIVE];
+    for (int i = 0; i < NUM_LIVE; i++) live[i] = my_malloc(24 + (i % 8) * 40);
+
+    // A freed block must be found again among many live ones
+    void *target = live[NUM_LIVE / 2];
+    size_t target_size = 24 + ((NUM_LIVE / 2) % 8) * 40;
+    my_free(target);
+    void *again = my_malloc(target_size);
+    printf("Freed block reused for same size: ");
+    print_test_result(again == target);
+
+    live[NUM_LIVE / 2] = again;
+    for (int i = 0; i < NUM_LIVE; i++) my_free(live[i]);
+}
+#define CACHE_THREADS 4
+#define CACHE_ROUNDS 200
+#define CACHE_OBJS 64
+
+void *thread_cache_worker(void *arg) 
+{
+    unsigned char tag = (unsigned char)(uintptr_t)arg;
+    unsigned char *objs[CACHE_OBJS];
+    int ok = 1;
+
+    for (int round = 0; round < CACHE_ROUNDS && ok; round++) 
+    {
+        for (int i = 0; i < CACHE_OBJS; i++) 
+        {
+            size_t size = 16 + (size_t)(i % 16) * 24;
+            objs[i] = my_malloc(size);
+            if (!objs[i]) 
+            {
+                ok = 0;
+                break;
+            }
+            memset(objs[i], tag, size);
+        }
+        for (int i = 0; i < CACHE_OBJS && objs[i]; i++) 
+        {
+            size_t size = 16 + (size_t)(i % 16) * 24;
+            for (size_t j = 0; j < size; j++) 
+            {
+                if (objs[i][j] != tag) ok = 0;
+            }
+            my_free(objs[i]);
+        }
+    }
+    return (void *)(uintptr_t)ok;
+}
+
+void test_thread_cache() 
+{
+    print_test_header("Thread Cache Test");
+
+    void *p = my_malloc(40);
+    my_free(p);
+    void *q = my_malloc(40);
+    printf("Recently freed block served from the thread cache: ");
+    print_test_result(p == q);
+    my_free(q);
+
+    pthread_t threads[CACHE_THREADS];
+    for (int i = 0; i < CACHE_THREADS; i++) pthread_create(&threads[i], NULL, thread_cache_worker, (void *)(uintptr_t)(i + 1));
+
+    int ok = 1;
+    for (int i = 0; i < CACHE_THREADS; i++) 
+    {
+        void *res;
+        pthread_join(threads[i], &res);
+        if (!res) ok = 0;
+    }
+    printf("Concurrent malloc/free keeps blocks private: ");
+    print_test_result(ok);
+}
+void *cross_arena_producer(void *arg) 
+{
+    void **objs = arg;
+    for (int i = 0; i < CACHE_OBJS; i++) 
+    {
+        objs[i] = my_malloc(600 + (size_t)i * 8); // Past the thread cache, straight from the arena
+        if (objs[i]) memset(objs[i], 0x5A, 600);
+    }
+    return NULL;
+}
+
+void test_cross_arena_free() 
+{
+    print_test_header("Cross-Arena Free Test");
+
+    void *objs[CACHE_OBJS];
+    pthread_t producer;
+    pthread_create(&producer, NULL, cross_arena_producer, objs);
+    pthread_join(producer, NULL);
+
+    int ok = 1;
+    for (int i = 0; i < CACHE_OBJS; i++) 
+    {
+        if (!objs[i]) ok = 0;
+        my_free(objs[i]); // Freed by a thread that never allocated them
+    }
+    printf("Blocks freed from another thread's arena: ");
+    print_test_result(ok);
+
+    void *p = my_malloc(600);
+    printf("Allocation after cross-arena frees: ");
+    print_test_result(p != NULL);
+    my_free(p);
+}
+int compare_ptrs(const void *a, const void *b) 
+{
+    uintptr_t x = (uintptr_t)*(void * const *)a, y = (uintptr_t)*(void * const *)b;
+    return (x > y) - (x < y);
+}
+
+void test_slab_small_objects() 
+{
+    print_test_header("Slab Small Object Test");
+
+    #define SLAB_OBJS 256
+    void *objs[SLAB_OBJS];
+    int ok = 1;
+    for (int i = 0; i < SLAB_OBJS; i++) 
+    {
+        objs[i] = my_malloc(32);
+        if (!objs[i]) ok = 0;
+        else memset(objs[i], i, 32);
+    }
+    printf("Allocated %d 32-byte objects: ", SLAB_OBJS);
+    print_test_result(ok);
+    if (!ok) return;
+
+    // Slab slots carry no header, so neighbours sit exactly one object apart
+    void *sorted[SLAB_OBJS];
+    memcpy(sorted, objs, sizeof(objs));
+    qsort(sorted, SLAB_OBJS, sizeof(void *), compare_ptrs);
+    int packed = 0;
+    for (int i = 1; i < SLAB_OBJS; i++) 
+    {
+        if ((char *)sorted[i] - (char *)sorted[i - 1] == 32) packed++;
+    }
+    printf("Objects packed without per-object headers: ");
+    print_test_result(packed >= SLAB_OBJS / 2);
+
+    for (int i = 0; i < SLAB_OBJS; i++) 
+    {
+        unsigned char *bytes = objs[i];
+        if (bytes[0] != (unsigned char)i || bytes[31] != (unsigned char)i) ok = 0;
+        my_free(objs[i]);
+    }
+    printf("Slot contents intact until free: ");
+    print_test_result(ok);
+}
+void test_compact_headers() 
+{
+    print_test_header("Compact Header Test");
+
+    #define HEADER_OBJS 16
+    void *objs[HEADER_OBJS];
+    int adjacent = 0;
+    for (int i = 0; i < HEADER_OBJS; i++) 
+    {
+        objs[i] = my_malloc(1008);
+        // Neighbouring used blocks are separated by a 16-byte header and no footer
+        if (i > 0 && objs[i] && (char *)objs[i] - (char *)objs[i - 1] == 1008 + 16) adjacent++;
+    }
+    printf("Used blocks carry a 16-byte header only: ");
+    print_test_result(adjacent > 0);
+
+    for (int i = 0; i < HEADER_OBJS; i++) my_free(objs[i]);
 }
             /*CALLOC TESTS*/
 void test_calloc_overflow() {
@@ -523,9 +702,11 @@ void test_realloc_edge_cases() {
     printf("Realloc that first 50 bytes should be preserved: ");
     void *ptr1 = my_malloc(100);
     memset(ptr1, 0xAB, 100);
+    unsigned char expected[50];
+    memset(expected, 0xAB, sizeof(expected));
     void *res = my_realloc(ptr1, 50);
-    //First 50 bytes should be preserved
-    print_test_result(memcmp(ptr1, res, 50) == 0);
+    //First 50 bytes should be preserved, ptr1 may have moved and been freed
+    print_test_result(res && memcmp(res, expected, 50) == 0);
 
     // Pointers should be the same
     /*void *ptr2 = my_malloc(80);
@@ -538,6 +719,784 @@ void test_realloc_edge_cases() {
     print_test_result(huge_ptr == NULL);
 }
 
+void test_realloc_in_place() {
+    print_test_header("Realloc In-Place Test");
+
+    char *p = my_malloc(1000);
+    char *q = my_malloc(1000);
+    if (!p || !q) {
+        print_test_result(0);
+        return;
+    }
+    memset(p, 0x3C, 1000);
+
+    // Shrinking splits the tail off instead of moving
+    char *shrunk = my_realloc(p, 600);
+    printf("Shrink keeps the block in place: ");
+    print_test_result(shrunk == p);
+
+    // Growing absorbs the freed neighbour
+    my_free(q);
+    char *grown = my_realloc(shrunk, 1800);
+    printf("Grow into a free neighbour keeps the block in place: ");
+    print_test_result(grown == p);
+
+    int data_ok = grown != NULL;
+    for (int i = 0; data_ok && i < 600; i++) {
+        if (grown[i] != 0x3C) data_ok = 0;
+    }
+    printf("Data preserved across in-place resizes: ");
+    print_test_result(data_ok);
+
+    print_memory_stats();
+    my_free(grown);
+}
+
+void test_realloc_large_remap() {
+    print_test_header("Large Realloc Remap Test");
+
+    size_t small = 1024 * 1024, big = 8 * 1024 * 1024;
+    unsigned char *p = my_malloc(small);
+    if (!p) {
+        print_test_result(0);
+        return;
+    }
+    for (size_t i = 0; i < small; i++) p[i] = (unsigned char)(i * 7);
+
+    unsigned char *grown = my_realloc(p, big);
+    int ok = grown != NULL;
+    for (size_t i = 0; ok && i < small; i++) {
+        if (grown[i] != (unsigned char)(i * 7)) ok = 0;
+    }
+    printf("Grow a mapped block to 8 MB: ");
+    print_test_result(ok);
+    if (!grown) return;
+    memset(grown + small, 0x11, big - small);
+
+    unsigned char *shrunk = my_realloc(grown, 64 * 1024);
+    ok = shrunk != NULL;
+    for (size_t i = 0; ok && i < 64 * 1024; i++) {
+        if (shrunk[i] != (unsigned char)(i * 7)) ok = 0;
+    }
+    printf("Shrink a mapped block back to 64 KB: ");
+    print_test_result(ok);
+    my_free(shrunk ? shrunk : grown);
+}
+
+void test_mapping_cache() {
+    print_test_header("Large Mapping Cache Test");
+
+    void *first = my_malloc(32 * 1024);
+    my_free(first);
+    void *second = my_malloc(32 * 1024 - 8); // Same page count, different size
+    printf("Freed 32 KB mapping is reused: ");
+    print_test_result(first != NULL && second == first);
+
+    memset(second, 0x5A, 32 * 1024 - 8);
+    my_free(second);
+
+    void *bufs[8];
+    int ok = 1;
+    for (int round = 0; round < 100 && ok; round++) {
+        for (int i = 0; i < 8; i++) {
+            bufs[i] = my_malloc((size_t)(8 + i * 8) * 1024);
+            if (!bufs[i]) ok = 0;
+            else memset(bufs[i], i, (size_t)(8 + i * 8) * 1024);
+        }
+        for (int i = 0; i < 8; i++) my_free(bufs[i]);
+    }
+    printf("Churn of 8-64 KB buffers: ");
+    print_test_result(ok);
+}
+
+void test_adaptive_mmap_threshold() {
+    print_test_header("Adaptive mmap Threshold Test");
+
+    size_t size = 200 * 1024;
+    for (int i = 0; i < 4; i++) {
+        void *p = my_malloc(size);
+        if (p) memset(p, i, size);
+        my_free(p);
+    }
+
+    // Once the size has moved to the heap, two live buffers sit next to each other
+    char *a = my_malloc(size);
+    char *b = my_malloc(size);
+    printf("Churning 200 KB buffers move to the heap: ");
+    print_test_result(a && b && b - a == (ptrdiff_t)(size + 16));
+    my_free(a);
+    my_free(b);
+}
+
+static long resident_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Options are read from the environment once, at the first allocation, so checks that
+// need other settings run in a fresh copy of this program started with them. The copy
+// runs only the named check, whose exit status has one bit set per failed result.
+static int run_isolated(const char *check, char *const env[])
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; env[i]; i++) putenv(env[i]);
+        execl("/proc/self/exe", "main", check, (char *)NULL);
+        _exit(255);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static size_t returned_bytes(void) {
+    MyMallinfo info;
+    my_mallinfo(&info);
+    return info.trimmed + info.purged;
+}
+
+// Frees large heap blocks with background purging on, then waits for the decay thread
+static int check_background_decay(void) {
+    int failed = 0;
+    void *objs[8];
+    for (int i = 0; i < 8; i++) {
+        objs[i] = my_malloc(500000);
+        if (!objs[i]) return 255;
+        memset(objs[i], 0xAB, 500000);
+    }
+    size_t before = returned_bytes();
+    for (int i = 0; i < 8; i++) my_free(objs[i]);
+    if (returned_bytes() != before) failed |= 1;
+
+    //The decay thread looks ten times per decay period, give it plenty of them
+    struct timespec pause = { 0, 50 * 1000000 };
+    for (int i = 0; i < 100 && returned_bytes() == before; i++) nanosleep(&pause, NULL);
+    if (returned_bytes() == before) failed |= 2;
+
+    void *p = my_malloc(500000);
+    if (!p) failed |= 4;
+    else memset(p, 0xCD, 500000);
+    my_free(p);
+
+    //A purged block split and merged again only has the touched part to give back
+    MyMallinfo info;
+    char *big = my_malloc(4 << 20);
+    void *guard = my_malloc(5000); // Keeps the block off the region's tail, so it is purged
+    if (!big || !guard) return failed | 8;
+    memset(big, 0xAB, 4 << 20);
+    my_free(big);
+    my_mallinfo(&info);
+    size_t purged = info.purged;
+    for (int i = 0; i < 100 && info.purged < purged + (3 << 20); i++) {
+        nanosleep(&pause, NULL);
+        my_mallinfo(&info);
+    }
+    if (info.purged < purged + (3 << 20)) failed |= 8;
+
+    purged = info.purged;
+    p = my_malloc(100000);
+    if (!p) return failed | 8;
+    memset(p, 0xCD, 100000);
+    my_free(p);
+    for (int i = 0; i < 100 && info.purged == purged; i++) {
+        nanosleep(&pause, NULL);
+        my_mallinfo(&info);
+    }
+    nanosleep(&pause, NULL);
+    my_mallinfo(&info);
+    if (info.purged == purged || info.purged > purged + 200000) failed |= 16;
+    my_free(guard);
+    return failed;
+}
+
+void test_background_decay() {
+    print_test_header("Background Decay Test");
+
+    char *env[] = { "MALLOCATOR_BACKGROUND=1", "MALLOCATOR_DECAY_MS=200", "MALLOCATOR_MMAP_THRESHOLD_MIN=8388608", NULL };
+    int failed = run_isolated("background-decay", env);
+
+    printf("Frees leave the pages to the decay thread: ");
+    print_test_result(failed >= 0 && !(failed & 1));
+    printf("Decay thread trims or purges the freed blocks: ");
+    print_test_result(failed >= 0 && !(failed & 2));
+    printf("Heap is usable after the decay: ");
+    print_test_result(failed >= 0 && !(failed & 4));
+    printf("Decay thread purges a block in the middle of the heap: ");
+    print_test_result(failed >= 0 && !(failed & 8));
+    printf("Pages purged once are not counted again: ");
+    print_test_result(failed >= 0 && !(failed & 16));
+}
+
+#define SEGMENT_BYTES (64UL * 1024 * 1024)
+#define COMMIT_STEP (256 * 1024)
+#define SEGMENT_OBJ 60000
+#define SEGMENT_OBJS 1200 // About 69 MB, more than one segment holds
+
+// Grows the heap a commit step at a time into a second segment, then frees it all
+static int check_segment_growth(void) {
+    int failed = 0;
+    static void *objs[SEGMENT_OBJS];
+    MyMallinfo start, grown, full, empty;
+    my_free(my_malloc(64)); // Reads the options, the first request sees the default threshold
+    my_mallinfo(&start);
+
+    //Ten objects take a few steps of the first segment, not all of it
+    for (int i = 0; i < 10; i++) {
+        objs[i] = my_malloc(SEGMENT_OBJ);
+        if (!objs[i]) return 255;
+        memset(objs[i], 0xAB, SEGMENT_OBJ);
+    }
+    my_mallinfo(&grown);
+    size_t step = grown.committed - start.committed;
+    if (step <= COMMIT_STEP || step > 10 * SEGMENT_OBJ + 2 * COMMIT_STEP || step % COMMIT_STEP) failed |= 1;
+
+    for (int i = 10; i < SEGMENT_OBJS; i++) {
+        objs[i] = my_malloc(SEGMENT_OBJ);
+        if (!objs[i]) return 255;
+        *(char *)objs[i] = 1;
+    }
+    my_mallinfo(&full);
+    if (full.reserved < start.reserved + 2 * SEGMENT_BYTES) failed |= 2;
+
+    for (int i = 0; i < SEGMENT_OBJS; i++) my_free(objs[i]);
+    my_mallinfo(&empty);
+    if (empty.reserved > full.reserved - SEGMENT_BYTES / 2 || empty.trimmed < full.trimmed + SEGMENT_BYTES / 2) failed |= 4;
+    if (empty.committed > full.committed - SEGMENT_BYTES / 2) failed |= 8;
+
+    void *p = my_malloc(SEGMENT_OBJ);
+    if (!p) failed |= 16;
+    else memset(p, 0xCD, SEGMENT_OBJ);
+    my_free(p);
+    return failed;
+}
+
+void test_segment_growth() {
+    print_test_header("Segment Growth Test");
+
+    char *env[] = { "MALLOCATOR_MMAP_THRESHOLD_MIN=1048576", NULL };
+    int failed = run_isolated("segment-growth", env);
+
+    printf("Heap grows by 256 KB commit steps: ");
+    print_test_result(failed >= 0 && !(failed & 1));
+    printf("A full segment is followed by a new one: ");
+    print_test_result(failed >= 0 && !(failed & 2));
+    printf("Emptied segment is unmapped and counted as trimmed: ");
+    print_test_result(failed >= 0 && !(failed & 4));
+    printf("Committed bytes drop with it: ");
+    print_test_result(failed >= 0 && !(failed & 8));
+    printf("Heap is usable after the unmap: ");
+    print_test_result(failed >= 0 && !(failed & 16));
+}
+
+#define HUGE_BYTES (3 * 1024 * 1024)
+
+// Asks for explicit huge pages, which fall back to normal pages when none are reserved
+static int check_hugepage_fallback(void) {
+    int failed = 0;
+
+    //The heap commits its first stretch on huge pages too
+    void *small = my_malloc(3000);
+    if (!small) failed |= 1;
+    else memset(small, 0xAB, 3000);
+
+    MyMallinfo before, during, after;
+    my_mallinfo(&before);
+    char *p = my_malloc(HUGE_BYTES);
+    if (!p) return failed | 2;
+    memset(p, 0xAB, HUGE_BYTES);
+    p = my_realloc(p, 2 * HUGE_BYTES);
+    if (!p || p[HUGE_BYTES - 1] != (char)0xAB) return failed | 2;
+    memset(p + HUGE_BYTES, 0xCD, HUGE_BYTES);
+    my_mallinfo(&during);
+
+    my_free(p);
+    my_free(small);
+    my_mallinfo(&after);
+    if (during.mapped < 2 * HUGE_BYTES || after.mapped != before.mapped || after.mmap_frees != before.mmap_frees + 1) failed |= 4;
+    return failed;
+}
+
+void test_hugepage_fallback() {
+    print_test_header("Huge Page Fallback Test");
+
+    char *env[] = { "MALLOCATOR_HUGEPAGES=2", NULL };
+    int failed = run_isolated("hugepage-fallback", env);
+
+    printf("Heap allocation with MALLOCATOR_HUGEPAGES=2: ");
+    print_test_result(failed >= 0 && !(failed & 1));
+    printf("3 MB allocation and 6 MB realloc succeed: ");
+    print_test_result(failed >= 0 && !(failed & 2));
+    printf("Large block is freed: ");
+    print_test_result(failed >= 0 && !(failed & 4));
+}
+
+void test_malloc_trim() {
+    print_test_header("Trim Test");
+
+    #define TRIM_OBJS 4096
+    static void *objs[TRIM_OBJS];
+    for (int i = 0; i < TRIM_OBJS; i++) {
+        objs[i] = my_malloc(2000);
+        if (objs[i]) memset(objs[i], 0xAB, 2000);
+    }
+    long peak = resident_kb();
+    for (int i = 0; i < TRIM_OBJS; i++) my_free(objs[i]);
+    int trimmed = my_malloc_trim(0);
+    long after = resident_kb();
+
+    printf("Freeing 8 MB of heap blocks lowers RSS (%ld kB -> %ld kB): ", peak, after);
+    print_test_result(peak < 0 || after <= peak - 4 * 1024);
+
+    void *p = my_malloc(2000);
+    printf("Heap is usable after trimming: ");
+    print_test_result(p != NULL && trimmed >= 0);
+    my_free(p);
+}
+
+#define CHURN_OBJ 40000
+#define CHURN_BATCH 32
+#define CHURN_ROUNDS 200
+
+// Heap-sized batches allocated and freed over and over, which must not decommit and
+// commit the top region's tail every round
+static int check_trim_churn(void) {
+    void *batch[CHURN_BATCH];
+    MyMallinfo before, after;
+    my_free(my_malloc(64)); // Reads the options, the first request sees the default threshold
+    my_mallinfo(&before);
+
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            batch[i] = my_malloc(CHURN_OBJ);
+            if (!batch[i]) return 255;
+            *(char *)batch[i] = 1;
+        }
+        for (int i = 0; i < CHURN_BATCH; i++) my_free(batch[i]);
+    }
+    my_mallinfo(&after);
+    return after.trimmed - before.trimmed > 4 * CHURN_BATCH * CHURN_OBJ;
+}
+
+void test_trim_churn() {
+    print_test_header("Trim Hysteresis Test");
+
+    char *env[] = { "MALLOCATOR_MMAP_THRESHOLD_MIN=1048576", NULL };
+    int failed = run_isolated("trim-churn", env);
+    printf("Repeated 1.3 MB heap churn stops trimming after a few rounds: ");
+    print_test_result(failed == 0);
+}
+
+void test_aligned_alloc() {
+    print_test_header("Aligned Allocation Test");
+
+    int ok = 1;
+    for (int i = 0; i < 64; i++) {
+        void *p = my_malloc((size_t)(i * 37 + 1));
+        if (!p || (uintptr_t)p % 16) ok = 0;
+        my_free(p);
+    }
+    printf("my_malloc returns 16-byte aligned blocks: ");
+    print_test_result(ok);
+
+    size_t alignments[] = {32, 64, 4096, 65536};
+    size_t sizes[] = {1, 100, 5000, 200 * 1024, 10 * 1024 * 1024};
+    void *blocks[4 * 5];
+    int n = 0;
+    ok = 1;
+    for (int a = 0; a < 4; a++) {
+        for (int s = 0; s < 5; s++) {
+            void *p = my_aligned_alloc(alignments[a], sizes[s]);
+            if (!p || (uintptr_t)p % alignments[a]) ok = 0;
+            else memset(p, a + s, sizes[s]);
+            blocks[n++] = p;
+        }
+    }
+    printf("my_aligned_alloc honours alignments up to 64 KB: ");
+    print_test_result(ok);
+    for (int i = 0; i < n; i++) my_free(blocks[i]);
+
+    void *q = NULL;
+    int rc = my_posix_memalign(&q, 128, 300);
+    printf("my_posix_memalign aligns to 128: ");
+    print_test_result(rc == 0 && q && (uintptr_t)q % 128 == 0);
+    my_free(q);
+
+    printf("my_posix_memalign rejects an alignment of 24: ");
+    print_test_result(my_posix_memalign(&q, 24, 300) == EINVAL);
+
+    void *m = my_memalign(48, 100); // Rounded up to 64
+    printf("my_memalign rounds the alignment up to a power of two: ");
+    print_test_result(m && (uintptr_t)m % 64 == 0);
+    my_free(m);
+}
+
+#define FRESH_ALIGNED 200
+
+// Mixed aligned requests carved from the zero memory of a fresh heap, every one
+// checked for overlap, freed and asked for again. Run with the heap walked on every call.
+static int check_aligned_fresh_heap(void) {
+    int failed = 0;
+    static unsigned char *objs[FRESH_ALIGNED];
+    static size_t sizes[FRESH_ALIGNED];
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < FRESH_ALIGNED; i++) {
+            size_t alignment = (size_t)32 << (i % 6); // 32 to 1024
+            sizes[i] = 16 + (size_t)(i * 53 + round * 7) % 3000;
+            void *p = NULL;
+            if (i % 2) {
+                if (my_posix_memalign(&p, alignment, sizes[i])) p = NULL;
+            }
+            else p = my_aligned_alloc(alignment, sizes[i]);
+            if (!p || (uintptr_t)p % alignment) return failed | 1;
+            objs[i] = p;
+            memset(p, i, sizes[i]);
+        }
+        for (int i = 0; i < FRESH_ALIGNED; i++) {
+            for (size_t j = 0; j < sizes[i]; j++) {
+                if (objs[i][j] != (unsigned char)i) failed |= 2;
+            }
+        }
+        for (int i = 0; i < FRESH_ALIGNED; i++) my_free(objs[i]);
+    }
+
+    //Everything freed must have merged back, a full walk checks every block on the way
+    my_malloc_trim(0);
+    MyHeapInfo info;
+    my_heap_info(&info);
+    void *p = my_malloc(info.largest_free);
+    if (!p || info.largest_free < FRESH_ALIGNED * 1024) failed |= 4;
+    my_free(p);
+    return failed;
+}
+
+void test_aligned_fresh_heap() {
+    print_test_header("Aligned Allocation on a Fresh Heap Test");
+
+    char *env[] = { "MALLOCATOR_VALIDATE=3", NULL };
+    int failed = run_isolated("aligned-fresh-heap", env);
+
+    printf("Mixed alignments on a fresh heap are honoured: ");
+    print_test_result(failed >= 0 && !(failed & 1));
+    printf("Aligned chunks do not overlap: ");
+    print_test_result(failed >= 0 && !(failed & 2));
+    printf("Freed chunks merge back and the heap walk stays consistent: ");
+    print_test_result(failed >= 0 && !(failed & 4));
+}
+
+void test_calloc_known_zero() {
+    print_test_header("calloc Known-Zero Test");
+
+    // Dirty the heap first so reused blocks would show through a skipped clear
+    size_t sizes[] = {600, 3000, 20000, 100 * 1024, 300 * 1024};
+    int ok = 1;
+    for (int round = 0; round < 4 && ok; round++) {
+        for (int i = 0; i < 5; i++) {
+            unsigned char *dirty = my_malloc(sizes[i]);
+            if (dirty) memset(dirty, 0xEE, sizes[i]);
+            my_free(dirty);
+
+            unsigned char *p = my_calloc(1, sizes[i]);
+            if (!p) ok = 0;
+            for (size_t j = 0; ok && j < sizes[i]; j++) {
+                if (p[j]) ok = 0;
+            }
+            memset(p, 0x77, sizes[i]);
+            my_free(p);
+        }
+    }
+    printf("Reused and fresh blocks come back zeroed: ");
+    print_test_result(ok);
+
+    size_t big = 64 * 1024 * 1024;
+    long before = resident_kb();
+    unsigned char *p = my_calloc(big, 1);
+    long after = resident_kb();
+    printf("64 MB calloc leaves its pages unfaulted (%ld kB -> %ld kB): ", before, after);
+    print_test_result(p && p[0] == 0 && p[big - 1] == 0 && (before < 0 || after - before < 16 * 1024));
+    my_free(p);
+}
+
+// Aligned chunks on a fresh heap split zero tails off zero blocks, and freeing them
+// merges one zero tail into the next
+static int check_zero_tail_coalesce(void) {
+    void *objs[64];
+    for (int i = 0; i < 64; i++) {
+        objs[i] = my_aligned_alloc(32, 16);
+        if (!objs[i]) return 1;
+    }
+    for (int i = 0; i < 64; i++) my_free(objs[i]);
+
+    unsigned char *p = my_calloc(1, 3000);
+    if (!p) return 1;
+    for (int i = 0; i < 3000; i++) {
+        if (p[i]) return 1;
+    }
+    my_free(p);
+    return 0;
+}
+
+void test_zero_tail_coalesce() {
+    print_test_header("Zero Tail Coalescing Test");
+
+    char *env[] = { NULL };
+    int failed = run_isolated("zero-tail-coalesce", env);
+    printf("Zero tails of aligned chunks merge on a fresh heap: ");
+    print_test_result(failed == 0);
+}
+
+static void *mallinfo_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) my_free(my_malloc(100));
+    return NULL;
+}
+
+void test_mallinfo() {
+    print_test_header("Statistics Test");
+
+    MyMallinfo before, during, after;
+    my_mallinfo(&before);
+
+    void *small[100];
+    for (int i = 0; i < 100; i++) small[i] = my_malloc(100);
+    void *large = my_malloc(40 * 1024 * 1024); // Above the highest mmap threshold
+    my_mallinfo(&during);
+
+    printf("Allocations are counted in their size class: ");
+    print_test_result(during.allocs[3] - before.allocs[3] == 100);
+
+    printf("Mapped allocation counted and its bytes live: ");
+    print_test_result(large && during.mmap_allocs == before.mmap_allocs + 1 && during.mapped >= before.mapped + 40 * 1024 * 1024 &&
+                      during.allocated >= before.allocated + 100 * 100 + 40 * 1024 * 1024);
+
+    for (int i = 0; i < 100; i++) my_free(small[i]);
+    my_free(large);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, mallinfo_worker, NULL);
+    pthread_join(thread, NULL);
+    my_mallinfo(&after);
+
+    printf("Frees bring allocated bytes back: ");
+    print_test_result(after.allocated == before.allocated && after.mmap_frees == before.mmap_frees + 1);
+
+    printf("Counts of exited threads are kept: ");
+    print_test_result(after.allocs[3] - before.allocs[3] == 1100 && after.frees[3] - before.frees[3] == 1100);
+
+    printf("Reserved covers committed: ");
+    print_test_result(after.reserved >= after.committed && after.committed > 0);
+}
+
+static const MyLatency *latency_path(const MyLatency *report, size_t n, const char *path) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(report[i].path, path) == 0) return &report[i];
+    }
+    return NULL;
+}
+
+void test_latency_histograms() {
+    print_test_header("Latency Histogram Test");
+
+    MyLatency before[32], after[32];
+    size_t n_before = my_latency_report(before, 32);
+    my_latency_enable(1);
+    for (int i = 0; i < 1000; i++) my_free(my_malloc(64));
+    my_free(my_malloc(40 * 1024 * 1024));
+    my_latency_enable(0);
+    size_t n_after = my_latency_report(after, 32);
+
+    const MyLatency *cached_before = latency_path(before, n_before, "malloc thread cache");
+    const MyLatency *cached = latency_path(after, n_after, "malloc thread cache");
+    const MyLatency *mapped_before = latency_path(before, n_before, "malloc mmap");
+    const MyLatency *mapped = latency_path(after, n_after, "malloc mmap");
+
+    printf("Thread cache hits are timed on their own path: ");
+    print_test_result(cached && cached->count - (cached_before ? cached_before->count : 0) >= 900);
+
+    printf("Percentiles are ordered: ");
+    print_test_result(cached && cached->p50_ns <= cached->p99_ns && cached->p99_ns <= cached->max_ns);
+
+    printf("Mappings are timed separately: ");
+    print_test_result(mapped && mapped->count - (mapped_before ? mapped_before->count : 0) == 1);
+
+    print_latency_stats();
+}
+
+// Reads the in-use and total sample counts from a heap profile header
+static int profile_header(const char *path, size_t *inuse, size_t *total, size_t *rate) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int fields = fscanf(f, "heap profile: %zu: %*u [%zu: %*u] @ heap_v2/%zu", inuse, total, rate);
+    fclose(f);
+    return fields == 3;
+}
+
+void test_heap_profile() {
+    print_test_header("Heap Profile Test");
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mallocator-profile-%d.heap", (int)getpid());
+    size_t inuse_before = 0, total_before = 0, rate = 0;
+    int ok = my_profile_dump(path) == 0 && profile_header(path, &inuse_before, &total_before, &rate);
+
+    // A rate of one byte samples every allocation
+    my_profile_set_rate(1);
+    void *ptrs[10];
+    for (int i = 0; i < 10; i++) {
+        ptrs[i] = my_malloc(1000);
+        if (ptrs[i]) memset(ptrs[i], i, 1000);
+    }
+    size_t inuse = 0, total = 0;
+    ok = ok && my_profile_dump(path) == 0 && profile_header(path, &inuse, &total, &rate);
+
+    printf("Sampled objects show up in the dump: ");
+    print_test_result(ok && inuse - inuse_before == 10 && total - total_before == 10 && rate == 1);
+
+    void *moved = my_realloc(ptrs[0], 2000);
+    printf("Sampled objects survive realloc: ");
+    print_test_result(moved && ((unsigned char*)moved)[999] == 0);
+    ptrs[0] = moved;
+
+    for (int i = 0; i < 10; i++) my_free(ptrs[i]);
+    my_profile_set_rate(0);
+    size_t inuse_after = 0;
+    ok = my_profile_dump(path) == 0 && profile_header(path, &inuse_after, &total, &rate);
+
+    printf("Freed samples leave the in-use counts: ");
+    print_test_result(ok && inuse_after == inuse_before && rate == 0);
+
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int maps = 0;
+    while (f && fgets(line, sizeof(line), f)) maps |= strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+    if (f) fclose(f);
+    printf("The dump carries the address space map: ");
+    print_test_result(maps);
+    unlink(path);
+}
+
+static void *trace_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) my_free(my_malloc(64));
+    return NULL;
+}
+
+void test_trace() {
+    print_test_header("Allocation Trace Test");
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mallocator-trace-%d.bin", (int)getpid());
+    int started = my_trace_start(path) == 0;
+    printf("A second trace cannot start: ");
+    print_test_result(started && my_trace_start(path) == -1 && errno == EBUSY);
+
+    void *p = my_malloc(100);
+    void *q = my_calloc(10, 10);
+    void *moved = my_realloc(p, 100000); // Moves, the malloc and free inside are not recorded
+    void *aligned = NULL;
+    my_posix_memalign(&aligned, 64, 200);
+    my_free(q);
+    my_free(moved);
+    my_free(aligned);
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_worker, NULL);
+    pthread_join(thread, NULL); // Its ring is flushed as it exits
+    int stopped = my_trace_stop() == 0;
+
+    MyTraceHeader header;
+    MyTraceEvent events[4096];
+    size_t n = 0;
+    FILE *f = fopen(path, "rb");
+    int header_ok = f && fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, MY_TRACE_MAGIC, 8) == 0 &&
+                    header.version == MY_TRACE_VERSION && header.event_size == sizeof(MyTraceEvent);
+    if (f) {
+        n = fread(events, sizeof(MyTraceEvent), 4096, f);
+        fclose(f);
+    }
+    unlink(path);
+
+    printf("The trace has a valid header: ");
+    print_test_result(started && stopped && header_ok);
+
+    size_t ops[MY_TRACE_FREE + 1] = {0};
+    int realloc_ok = 0, aligned_ok = 0, worker_events = 0;
+    uint32_t main_thread = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (events[i].op > MY_TRACE_FREE) continue;
+        ops[events[i].op]++;
+        if (events[i].op == MY_TRACE_MALLOC && events[i].ptr == (uintptr_t)p) main_thread = events[i].thread;
+        if (events[i].op == MY_TRACE_REALLOC) realloc_ok = events[i].arg == (uintptr_t)p && events[i].ptr == (uintptr_t)moved && events[i].size == 100000;
+        if (events[i].op == MY_TRACE_ALIGNED) aligned_ok = events[i].arg == 64 && events[i].ptr == (uintptr_t)aligned;
+    }
+    for (size_t i = 0; i < n; i++) worker_events += events[i].thread != main_thread;
+
+    printf("Every call is recorded once: ");
+    print_test_result(n == 2007 && ops[MY_TRACE_MALLOC] == 1001 && ops[MY_TRACE_CALLOC] == 1 && ops[MY_TRACE_REALLOC] == 1 &&
+                      ops[MY_TRACE_ALIGNED] == 1 && ops[MY_TRACE_FREE] == 1003);
+
+    printf("Realloc and aligned events carry their arguments: ");
+    print_test_result(realloc_ok && aligned_ok);
+
+    printf("Threads are told apart: ");
+    print_test_result(main_thread && worker_events == 2000);
+}
+
+void test_free_sized() {
+    print_test_header("Sized Free Test");
+
+    // Thread cache chunks are reused last in, first out
+    void *small = my_malloc(40);
+    my_free_sized(small, 40);
+    void *again = my_malloc(40);
+    printf("A slab class goes straight back to its bin: ");
+    print_test_result(again == small);
+    my_free_sized(again, 40);
+
+    void *heap = my_malloc(400); // Above the slab cutoff, served by the heap
+    my_free_sized(heap, 400);
+    again = my_malloc(400);
+    printf("A heap chunk goes back by its header size: ");
+    print_test_result(again == heap);
+
+    MyMallinfo before, after;
+    size_t usable = my_malloc_usable_size(again);
+    my_mallinfo(&before);
+    my_free_sized(again, 400);
+    void *large = my_malloc(40 * 1024 * 1024); // Above the highest mmap threshold
+    my_free_sized(large, 40 * 1024 * 1024);
+    my_mallinfo(&after);
+    printf("Sized frees are counted: ");
+    print_test_result(after.heap_frees - before.heap_frees == 1 && after.mmap_frees - before.mmap_frees == 1 &&
+                      after.allocated == before.allocated - usable);
+
+    // Sized frees after realloc take the size of the realloc, even when it shrank in place
+    void *shrunk = my_realloc(my_malloc(40), 20);
+    void *from_heap = my_realloc(my_malloc(1000), 20);
+    my_free_sized(shrunk, 20);
+    my_free_sized(from_heap, 20);
+    void *a = my_malloc(20), *b = my_malloc(20);
+    printf("Shrunk chunks come back for their new size: ");
+    print_test_result(my_malloc_usable_size(a) == 32 && my_malloc_usable_size(b) == 32 &&
+                      ((a == shrunk && b == from_heap) || (a == from_heap && b == shrunk)));
+    my_free_sized(a, 20);
+    my_free_sized(b, 20);
+
+    // A profile sample of a slab size has a mapping of its own, which must not reach the cache
+    my_profile_set_rate(1);
+    void *sampled = my_malloc(64);
+    my_profile_set_rate(0);
+    my_mallinfo(&before);
+    my_free_sized(sampled, 64);
+    my_mallinfo(&after);
+    printf("Small mappings are still unmapped: ");
+    print_test_result(after.mmap_frees - before.mmap_frees == 1);
+}
+
 void test_realloc_random() {
     print_test_header("Random Realloc Stress Test");
     
@@ -583,8 +1542,22 @@ void test_realloc_random() {
 }
 
 
-int main() 
+// Entry point of the copies started by run_isolated
+static int run_check(const char *check)
 {
+    if (!strcmp(check, "background-decay")) return check_background_decay();
+    if (!strcmp(check, "segment-growth")) return check_segment_growth();
+    if (!strcmp(check, "hugepage-fallback")) return check_hugepage_fallback();
+    if (!strcmp(check, "zero-tail-coalesce")) return check_zero_tail_coalesce();
+    if (!strcmp(check, "aligned-fresh-heap")) return check_aligned_fresh_heap();
+    if (!strcmp(check, "trim-churn")) return check_trim_churn();
+    return 255;
+}
+
+int main(int argc, char **argv) 
+{
+    if (argc > 1) return run_check(argv[1]);
+
     printf("%sStarting Memory Allocator Test Suite%s\n\n", COLOR_GREEN, COLOR_RESET);
     
     //Malloc tests
@@ -594,6 +1567,11 @@ int main()
     test_random_allocations();
     test_edge_cases();
     test_coalescing();
+    test_size_class_reuse();
+    test_thread_cache();
+    test_cross_arena_free();
+    test_slab_small_objects();
+    test_compact_headers();
     
     //Calloc tests
     test_calloc_overflow();
@@ -609,6 +1587,24 @@ int main()
     test_realloc_zero_size();
     test_realloc_coalescing();
     test_realloc_edge_cases();
+    test_realloc_in_place();
+    test_realloc_large_remap();
+    test_mapping_cache();
+    test_adaptive_mmap_threshold();
+    test_malloc_trim();
+    test_background_decay();
+    test_segment_growth();
+    test_hugepage_fallback();
+    test_trim_churn();
+    test_aligned_alloc();
+    test_aligned_fresh_heap();
+    test_calloc_known_zero();
+    test_zero_tail_coalesce();
+    test_mallinfo();
+    test_latency_histograms();
+    test_heap_profile();
+    test_trace();
+    test_free_sized();
     test_realloc_random();
 
     printf("\n%sAll tests completed!%s\n", COLOR_GREEN, COLOR_RESET);
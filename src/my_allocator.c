@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // mremap
 #include <stdbool.h>
 #include <stdlib.h>
 #include "my_allocator.h"
@@ -8,8 +9,11 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
-
-static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include <time.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdarg.h>
 
 #ifndef MAP_ANONYMOUS
     #ifdef MAP_ANON
@@ -20,427 +24,3219 @@ static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
     #endif
 #endif
 
-#define FREED_MAGIC 0xDEADBEEFDEADBEEF
-#define ALLOC_MAGIC 0xBADC0DEDEAD1234
+#define FREED_MAGIC 0xDEADBEEF
+#define ALLOC_MAGIC 0xBADC0DED
+#define SLAB_MAGIC 0x51AB51AB
 
+// Every heap block starts with this header. The payload size is a multiple of
+// ALIGNMENT, which leaves its low bits free for the block flags.
 typedef struct Block {
-    size_t size;
-    size_t magic;
-    bool free;
-    bool is_mmap; // Flag to indicate if the block was allocated using mmap
-    struct Block* next;
-    struct Block* prev;
+    size_t size;     // Payload size | BLOCK_* flags
+    uint32_t magic;
+    uint32_t arena;  // Index of the owning arena
 } Block;
+
+#define BLOCK_FREE 1UL      // Block is in a bin
+#define BLOCK_MMAP 2UL      // Block has a mapping of its own
+#define BLOCK_PREV_FREE 4UL // Physically previous block is free, so its footer is valid
+#define BLOCK_ZERO 8UL      // Payload is untouched zero pages, see ZERO_HEAD
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_MMAP | BLOCK_PREV_FREE | BLOCK_ZERO)
  
+// Only free blocks carry a footer, in the last bytes of their payload
 typedef struct Footer
 {
     size_t size; //for coleascing
 }Footer;
 
+// Bin links, kept in the first bytes of a free block's payload
+typedef struct FreeLinks {
+    Block* next_free;
+    Block* prev_free;
+} FreeLinks;
+
+// A BLOCK_ZERO heap block only carries free-block metadata in its payload: the bin
+// links and decay stamp in the first ZERO_HEAD bytes and the footer in the last ones.
+// Mapped blocks are zero throughout. Live blocks may keep a stale flag, so it is only
+// trusted right after the block was taken from a bin or mapped.
+#define ZERO_HEAD (sizeof(FreeLinks) + sizeof(uint64_t))
+
 #define BLOCK_SIZE sizeof(struct Block)
-#define MIN_BLOCK_SIZE (ALIGN( sizeof(struct Block) + sizeof(struct Footer) + ALIGNMENT))
+#define MIN_PAYLOAD (sizeof(FreeLinks) + sizeof(Footer))
+#define MIN_BLOCK_SIZE (ALIGN(sizeof(struct Block) + MIN_PAYLOAD))
+#define MIN_CHUNK_SIZE 16 // Smallest payload handed out, room for a thread cache entry
+
+// Small requests up to slab_cutoff bytes are carved from SLAB_SIZE-aligned slabs of
+// equal slots, one slab list per ALIGNMENT step. Slots carry no header, the owning
+// slab is found through the page map.
+#ifndef SLAB_CUTOFF
+#define SLAB_CUTOFF 256
+#endif
+#define SLAB_MAX_CUTOFF 1024
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_CLASSES (SLAB_MAX_CUTOFF / ALIGNMENT + 1)
+
+static size_t slab_cutoff = SLAB_CUTOFF;
+
+// MALLOCATOR_BEST_FIT=1 turns the allocator into a plain best-fit baseline for
+// placement comparisons: no slabs, no thread cache, and the smallest fitting free
+// block wins, where the bins otherwise hand out any block of the next size class.
+static bool best_fit;
+
+typedef struct Slab {
+    uint32_t magic;
+    unsigned arena;       // Index of the owning arena
+    size_t obj_size;
+    unsigned capacity;    // Slots in this slab
+    unsigned used;        // Slots handed out, including those sitting in thread caches
+    unsigned hint;        // No free slot below this bitmap word
+    struct Slab* next;    // Links in the arena's list of slabs with free slots
+    struct Slab* prev;
+    char *objects;
+    uint64_t bitmap[];    // One bit per slot, set while the slot is in use
+} Slab;
+
+// Free blocks are indexed by size class. Sizes below SMALL_BIN_LIMIT get one
+// exact bin per ALIGNMENT step, larger sizes get SUB_BINS bins per power of two.
+#define NUM_SMALL_BINS 64
+#define SMALL_BIN_LIMIT (NUM_SMALL_BINS * ALIGNMENT)
+#define SUB_BIN_BITS 2
+#define SUB_BINS (1 << SUB_BIN_BITS)
+#define NUM_BINS (NUM_SMALL_BINS + (64 - __builtin_ctzl(SMALL_BIN_LIMIT)) * SUB_BINS)
+#define BINMAP_WORDS ((NUM_BINS + 63) / 64)
+
+// A contiguous stretch of heap memory. Blocks follow the region header back to back
+// and a zero-sized used block (the fencepost) closes the region, so neighbours are
+// found by address and never walk off the end.
+//
+// Each region sits at the start of a segment: SEGMENT_SIZE bytes of address space,
+// aligned to SEGMENT_SIZE and reserved without backing. The owning arena commits it
+// SEGMENT_COMMIT bytes at a time as the region grows, and the page map finds the
+// segment of any heap pointer in one lookup.
+#define SEGMENT_SIZE (64UL * 1024 * 1024)
+#define SEGMENT_COMMIT (256 * 1024)
+
+// Opt-in huge page backing for segments and large mappings: 0 off, 1 transparent
+// huge pages through madvise, 2 explicit MAP_HUGETLB pages, falling back to 1 once
+// the kernel has no huge pages to give. Segments then commit a huge page at a time.
+#ifndef MALLOCATOR_HUGEPAGES
+#define MALLOCATOR_HUGEPAGES 0
+#endif
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+static size_t hugepages = MALLOCATOR_HUGEPAGES;
+static bool hugetlb_unavailable;
+static size_t huge_explicit_bytes; // Live bytes on MAP_HUGETLB pages
+static size_t huge_advised_bytes;  // Live bytes advised with MADV_HUGEPAGE
+
+// Freed heap memory goes back to the kernel: a region whose tail is a free block of
+// at least trim_threshold bytes gives back all but the arena's trim pad of it, an emptied
+// segment other than the arena's top one is unmapped, and a freed block of at least
+// purge_threshold bytes has its pages dropped with MADV_DONTNEED. 0 disables either.
+// The pad starts at TRIM_PAD and doubles, up to TRIM_PAD_MAX, whenever the heap has to
+// commit a trimmed tail again, so a steady churn stops trimming after a few rounds.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1024 * 1024)
+#endif
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD (1024 * 1024)
+#endif
+#define TRIM_PAD SEGMENT_COMMIT
+#define TRIM_PAD_MAX (32 * 1024 * 1024)
+
+static size_t trim_threshold = TRIM_THRESHOLD;
+static size_t purge_threshold = PURGE_THRESHOLD;
+static size_t trimmed_bytes; // Returned by shrinking or unmapping segments
+static size_t purged_bytes;  // Dropped from the middle of free blocks
+
+// Address space totals, kept current so statistics never have to walk the arenas
+static size_t heap_reserved;  // Heap segments
+static size_t heap_committed; // Committed part of the heap segments, purged pages included
+static size_t slab_mapped;
+
+// With MALLOCATOR_BACKGROUND set, frees never trim or purge. A background thread
+// instead returns the pages of free blocks that have stayed free for decay_ms, so
+// foreground threads do not pay the syscalls. It looks DECAY_STEPS times per decay
+// period, so pages go back between decay_ms and decay_ms * (1 + 1 / DECAY_STEPS) after
+// their last free.
+#ifndef MALLOCATOR_DECAY_MS
+#define MALLOCATOR_DECAY_MS 10000
+#endif
+#define DECAY_STEPS 10
+
+static bool background;
+// Optional instrumentation, one bit per feature, so the public entry points test a
+// single word while all of it is off
+#define HOOK_LATENCY 1U // Latency histograms
+#define HOOK_PROFILE 2U // Sampling heap profiler
+#define HOOK_TRACE 4U   // Allocation trace recording
+static unsigned hooks;
+static size_t profile_rate; // Mean bytes between heap profile samples, 0 when off
+static size_t decay_ms = MALLOCATOR_DECAY_MS;
+
+typedef struct HeapRegion {
+    struct HeapRegion* next;
+    size_t size;     // Committed bytes, from the region header to the end of the fencepost
+    size_t reserved; // Bytes of address space behind the region
+    size_t hugetlb_end; // Committed bytes below this offset sit on explicit huge pages
+    unsigned arena;  // Index of the owning arena
+} HeapRegion;
+
+// Every arena is an independent heap with its own lock, segments and bins
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4
+
+typedef struct Arena {
+    pthread_mutex_t lock;
+    HeapRegion* regions;
+    HeapRegion* top;               // Region still growing into its segment
+    Block* bins[NUM_BINS];
+    uint64_t binmap[BINMAP_WORDS]; // Bit set for every non-empty bin
+    Slab* slabs[SLAB_CLASSES];     // Slabs with at least one free slot, per class
+    size_t slab_count;
+    size_t slab_used_bytes;
+    unsigned long ops; // Heap operations, paces sampled validation
+    size_t trim_pad;   // Bytes of the top region's free tail that trimming on free keeps
+    bool top_trimmed;  // The top region was trimmed on free since it last grew
+    unsigned index;
+    unsigned threads;  // Threads currently attached, used to balance new threads
+    bool initialized;
+} Arena;
+
+static Arena arenas[MAX_ARENAS];
+static unsigned narenas;
+static unsigned next_arena; // Round-robin start for the least-loaded search
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Heap checking levels: 0 off, 1 constant-time checks on the blocks an operation
+// touches, 2 adds a full walk of the arena every VALIDATE_INTERVAL operations,
+// 3 walks the arena before and after every operation.
+#ifndef MALLOCATOR_VALIDATE
+#define MALLOCATOR_VALIDATE 1
+#endif
+#define VALIDATE_INTERVAL 1024
+
+static size_t validate_level = MALLOCATOR_VALIDATE;
+
+// mmap'd blocks live outside the arenas and are only counted
+static size_t mmap_blocks;
+static size_t mmap_bytes;
+static bool small_mapped; // A mapping was handed out for a thread cache size, see free_sized_path
+
+// The mmap threshold moves between these bounds at run time. A large block that is
+// allocated again within MMAP_CHURN_WINDOW_MS of a block with the same page count
+// being freed lifts the threshold above its size, so that size moves to the heap.
+#define MMAP_CHURN_WINDOW_MS 1000
+#define MMAP_CHURN_SLOTS 64
+
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t mmap_threshold_min = MMAP_THRESHOLD;
+static size_t mmap_threshold_max = MMAP_THRESHOLD_MAX;
+static uint64_t mmap_churn[MMAP_CHURN_SLOTS]; // Page count << 32 | release time in ms
 
-Block* head = NULL;
-Block* tail = NULL;
+#define IS_MMAP(size) ((size) >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
 
-Block *find_best_fit(size_t size) 
+// Freed large mappings are kept for reuse, bucketed by page count, instead of going
+// straight back to the kernel. The cache holds at most mapcache_limit bytes and
+// unmaps whatever sat unused for mapcache_decay_ms.
+#ifndef MAPCACHE_LIMIT
+#define MAPCACHE_LIMIT (16 * 1024 * 1024)
+#endif
+#ifndef MAPCACHE_DECAY_MS
+#define MAPCACHE_DECAY_MS 1000
+#endif
+#define MAPCACHE_MAX_PAGES 256 // Bigger mappings are never cached
+
+static size_t mapcache_limit = MAPCACHE_LIMIT;
+static size_t mapcache_decay_ms = MAPCACHE_DECAY_MS;
+
+// How often my_realloc could keep the block where it was, remap it, or had to copy it
+static size_t realloc_in_place;
+static size_t realloc_remapped;
+static size_t realloc_moved;
+
+static uint64_t now_ms(void)
 {
-    Block* best = NULL;
-    Block* current = head;
-    while(current) //Iterate through the linked list of blocks
-    {
-        if(current->magic != ALLOC_MAGIC && current->magic != FREED_MAGIC) 
-        {
-            fprintf(stderr, "Corrupted block detected at %p\n", (void*)current);
-            return NULL;
-        }
-        if(current->free && current->size >= size)
-        {
-            if(!best || current->size < best->size) //Find the smallest block that fits
-            {
-                best = current;
-                // Perfect fit found, stop searching
-                if (best->size == size) break;
-            }
-        }
-        current = current->next;
-    }   
-    return best; //Return the best fit block
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static size_t block_size(const Block *block)
+{
+    return block->size & ~BLOCK_FLAGS;
+}
+
+static bool block_is_free(const Block *block)
+{
+    return block->size & BLOCK_FREE;
+}
+
+static FreeLinks *free_links(Block *block)
+{
+    return (FreeLinks*)((char*)block + sizeof(Block));
+}
+
+// Free blocks of at least a page keep the time they were freed right after their bin
+// links while background purging is on. Zero once their pages have been purged.
+#define STAMPED_SIZE (1UL << 12)
+
+static uint64_t *free_stamp(Block *block)
+{
+    return (uint64_t*)((char*)free_links(block) + sizeof(FreeLinks));
+}
+
+static Block *next_block(Block *block)
+{
+    return (Block*)((char*)block + sizeof(Block) + block_size(block));
 }
 
 Footer* get_Footer(Block *block) 
 {
     if(!block) return NULL;
 
+    return (Footer*)((char*)block + sizeof(Block) + block_size(block) - sizeof(Footer));
+}
+
+// Only valid while BLOCK_PREV_FREE is set
+static Block *prev_block(Block *block)
+{
+    Footer *foot = (Footer*)((char*)block - sizeof(Footer));
+    return (Block*)((char*)block - foot->size - sizeof(Block));
+}
+
+static Block *region_first_block(HeapRegion *region)
+{
+    return (Block*)((char*)region + ALIGN(sizeof(HeapRegion)));
+}
+
+static Block *region_fencepost(HeapRegion *region)
+{
+    return (Block*)((char*)region + region->size - sizeof(Block));
+}
+
+static size_t bin_index(size_t size)
+{
+    if(size < SMALL_BIN_LIMIT) return size / ALIGNMENT;
+
+    size_t log = 63 - __builtin_clzl(size);
+    size_t sub = (size >> (log - SUB_BIN_BITS)) & (SUB_BINS - 1);
+    size_t idx = NUM_SMALL_BINS + (log - __builtin_ctzl(SMALL_BIN_LIMIT)) * SUB_BINS + sub;
+
+    return idx < NUM_BINS ? idx : NUM_BINS - 1;
+}
+
+static void bin_insert(Arena *arena, Block *block)
+{
+    size_t idx = bin_index(block_size(block));
+    FreeLinks *links = free_links(block);
+
+    links->prev_free = NULL;
+    links->next_free = arena->bins[idx];
+    if(arena->bins[idx]) free_links(arena->bins[idx])->prev_free = block;
+    arena->bins[idx] = block;
+    arena->binmap[idx / 64] |= 1UL << (idx % 64);
+}
+
+static void bin_remove(Arena *arena, Block *block)
+{
+    size_t idx = bin_index(block_size(block));
+    FreeLinks *links = free_links(block);
 
-    if(block->is_mmap && block->magic != ALLOC_MAGIC && block->magic != FREED_MAGIC) return NULL;
+    if(links->prev_free) free_links(links->prev_free)->next_free = links->next_free;
+    else arena->bins[idx] = links->next_free;
+    if(links->next_free) free_links(links->next_free)->prev_free = links->prev_free;
 
-    return (Footer*)((char*)block + sizeof(Block) + block->size);
+    if(!arena->bins[idx]) arena->binmap[idx / 64] &= ~(1UL << (idx % 64));
 }
 
+// Returns the first non-empty bin at or above idx, or NUM_BINS if there is none
+static size_t next_nonempty_bin(Arena *arena, size_t idx)
+{
+    size_t word = idx / 64;
+    uint64_t bits = arena->binmap[word] & (~0UL << (idx % 64));
+
+    while(!bits)
+    {
+        if(++word == BINMAP_WORDS) return NUM_BINS;
+        bits = arena->binmap[word];
+    }
+    return word * 64 + __builtin_ctzl(bits);
+}
 
-void validate_heap() 
+Block *find_best_fit(Arena *arena, size_t size) 
 {
-    Block *current = head;
-    size_t count = 0;
-    
-    while(current) 
+    size_t idx = bin_index(size);
+    Block* best = NULL;
+
+    //Only the starting bin can hold blocks smaller than the request, so pick the best fit in it
+    for(Block* current = arena->bins[idx]; current; current = free_links(current)->next_free)
     {
-        
-        if(count++ > 1000) 
+        if(current->magic != FREED_MAGIC) 
         {
-            fprintf(stderr, "Possible infinite loop in block list\n");
-            assert(0);
+            fprintf(stderr, "Corrupted block detected at %p\n", (void*)current);
+            return NULL;
+        }
+        if(block_size(current) >= size && (!best || block_size(current) < block_size(best)))
+        {
+            best = current;
+            if(block_size(best) == size) break; // Perfect fit found, stop searching
         }
-        
-        
-        if(!current->is_mmap && ((void*)current < (void*)head || (void*)current > sbrk(0)))
+    }
+    if(best) return best;
+
+    //Every block in a higher bin fits, take the first one of the smallest class
+    idx = next_nonempty_bin(arena, idx + 1);
+    if(idx >= NUM_BINS) return NULL;
+    if(!best_fit) return arena->bins[idx];
+
+    //Blocks in later bins are all larger, so the smallest of this one is the best fit
+    for(Block *current = arena->bins[idx]; current; current = free_links(current)->next_free)
+    {
+        if(!best || block_size(current) < block_size(best)) best = current;
+    }
+    return best;
+}
+
+
+static HeapRegion *region_of(const void *ptr);
+
+// Full walk of an arena's regions and bins, O(heap size)
+void validate_heap(Arena *arena) 
+{
+    size_t free_blocks = 0, binned_blocks = 0;
+
+    for(HeapRegion *region = arena->regions; region; region = region->next)
+    {
+        Block *current = region_first_block(region);
+        Block *fencepost = region_fencepost(region);
+        bool prev_free = false;
+
+        if(region->arena != arena->index || region->size > region->reserved || region_of(current + 1) != region)
         {
-            fprintf(stderr, "Block %p outside heap boundaries\n", (void*)current);
+            fprintf(stderr, "Region %p not registered to arena %u\n", (void*)region, arena->index);
             assert(0);
         }
-        
-        if(current->is_mmap)
+
+        while(current != fencepost)
         {
-            
-            if(current->magic != ALLOC_MAGIC && current->magic != FREED_MAGIC)
+            if(current < region_first_block(region) || current > fencepost) 
             {
-                fprintf(stderr, "Invalid mmap block at %p\n", (void*)current);
+                fprintf(stderr, "Block %p outside region %p\n", (void*)current, (void*)region);
                 assert(0);
             }
-        }
-        else 
-        {
-           
+
             if(current->magic != ALLOC_MAGIC && current->magic != FREED_MAGIC) 
             {
-                fprintf(stderr, "Invalid magic in block %p: 0x%lx\n", 
+                fprintf(stderr, "Invalid magic in block %p: 0x%x\n", 
                       (void*)current, current->magic);
                 assert(0);
             }
-        }
-        
-        
-        if(current->next)
-        {
-            
-            if (current->next && !current->next->is_mmap && ((void*)current->next < (void*)head || (void*)current->next > sbrk(0)))
+
+            if(block_size(current) == 0 || (current->size & BLOCK_MMAP)) 
             {
-                fprintf(stderr, "Invalid next pointer in block %p\n", (void*)current);
+                fprintf(stderr, "Invalid size in block %p\n", (void*)current);
                 assert(0);
             }
-            
-           
-            if(current->next->prev != current) 
+
+            if(!!(current->size & BLOCK_PREV_FREE) != prev_free) 
             {
-                fprintf(stderr, "Invalid next->prev link in block %p\n", (void*)current);
+                fprintf(stderr, "Stale previous-free flag in block %p\n", (void*)current);
                 assert(0);
             }
+
+            if(block_is_free(current)) 
+            {
+                if(prev_free) 
+                {
+                    fprintf(stderr, "Uncoalesced free blocks at %p\n", (void*)current);
+                    assert(0);
+                }
+                if(get_Footer(current)->size != block_size(current)) 
+                {
+                    fprintf(stderr, "Footer mismatch in block %p\n", (void*)current);
+                    assert(0);
+                }
+                free_blocks++;
+            }
+
+            prev_free = block_is_free(current);
+            current = next_block(current);
         }
-        
-        
-        Block *fast = current->next ? current->next->next : NULL;
-        if(fast == current) 
+
+        if(fencepost->magic != ALLOC_MAGIC || block_size(fencepost) || !!(fencepost->size & BLOCK_PREV_FREE) != prev_free)
         {
-            fprintf(stderr, "Circular reference detected at %p\n", (void*)current);
+            fprintf(stderr, "Broken fencepost at %p\n", (void*)fencepost);
             assert(0);
         }
-        
-        current = current->next;
     }
-}
-
-Block *request_space(size_t size)
-{
-    void *request;
-    Block *block;
 
-    if (IS_MMAP(size)) 
-    {    
-        request = mmap(NULL, size + sizeof(Block) + sizeof(Footer),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (request == MAP_FAILED) return NULL;
-        
-        block = (Block*)request;
-        memset(block,0,sizeof(Block));
-        block->magic = ALLOC_MAGIC;
-        block->size = size;
-        block->free = false;
-        block->next = NULL;
-        block->prev = tail;
-        block->is_mmap = true;
-    }
-    else
+    for(size_t idx = 0; idx < NUM_BINS; idx++)
     {
-        size_t page_size = getpagesize();
-        size_t full_block = ALIGN(sizeof(Block) + ALIGN(size) + sizeof(Footer));
-        size_t request_size = ((full_block + page_size - 1) / page_size) * page_size;
-        
-        request = sbrk(request_size);
-        if (request == (void*)-1) return NULL;
-        
-        block = (Block*)request;
-        memset(block, 0, sizeof(Block));
-        block->magic = ALLOC_MAGIC;
-        block->size = request_size - sizeof(Block) - sizeof(Footer);
-        block->free = false;
-        block->next = NULL;
-        block->prev = tail;
-        block->is_mmap = false;
-    }
-
-    Footer *foot = get_Footer(block);
-    if(!foot)
-    {
-        if(block->is_mmap)
+        if(!arena->bins[idx] != !(arena->binmap[idx / 64] & (1UL << (idx % 64))))
         {
-            munmap(block, block->size + sizeof(Block) + sizeof(Footer));
+            fprintf(stderr, "Bin map out of sync for bin %zu\n", idx);
+            assert(0);
+        }
+
+        for(Block *current = arena->bins[idx]; current; current = free_links(current)->next_free)
+        {
+            if(current->magic != FREED_MAGIC || !block_is_free(current) || bin_index(block_size(current)) != idx)
+            {
+                fprintf(stderr, "Misfiled block %p in bin %zu\n", (void*)current, idx);
+                assert(0);
+            }
+            binned_blocks++;
         }
-        return NULL;
     }
-    foot->size = block->size;
-    
-    // Update global list
-   if (!head) head = block;
-    
-   if (tail)
-    {
-        tail->next = block;
-        block->prev = tail;  // Make sure to set prev pointer
-    } 
-    else block->prev = NULL;  // First block has no previous
 
-    tail = block;
-    
-    return block;
+    if(free_blocks != binned_blocks)
+    {
+        fprintf(stderr, "%zu free blocks but %zu in bins\n", free_blocks, binned_blocks);
+        assert(0);
+    }
 }
 
-void split(Block *block, size_t size)
+static void maybe_validate_heap(Arena *arena)
 {
-    size_t remaining_size = block->size - size - sizeof(Block) - sizeof(Footer);
+    if(validate_level >= 3 || (validate_level == 2 && ++arena->ops % VALIDATE_INTERVAL == 0)) validate_heap(arena);
+}
 
-    if(block->is_mmap || (remaining_size < MIN_BLOCK_SIZE)) return;
+// Constant-time checks on a block about to change hands: its own header, its
+// footer when free, and the boundary tags it shares with both neighbours.
+static bool check_block(Block *block, bool expect_free)
+{
+    const char *problem = NULL;
+    Block *next = next_block(block);
 
-    Block *new_block = (Block*)((char*)block + sizeof(Block) + size);
+    if(block->magic != (expect_free ? FREED_MAGIC : ALLOC_MAGIC) || block_is_free(block) != expect_free) problem = "Unexpected block state";
+    else if(!block_size(block) || block_size(block) % ALIGNMENT || (block->size & BLOCK_MMAP)) problem = "Invalid size";
+    else if(expect_free && get_Footer(block)->size != block_size(block)) problem = "Footer mismatch";
+    else if(next->magic != ALLOC_MAGIC && next->magic != FREED_MAGIC) problem = "Invalid magic after block";
+    else if(!!(next->size & BLOCK_PREV_FREE) != expect_free) problem = "Stale previous-free flag after block";
+    else if(block->size & BLOCK_PREV_FREE)
+    {
+        Block *prev = prev_block(block);
+        if(prev->magic != FREED_MAGIC || !block_is_free(prev) || next_block(prev) != block) problem = "Broken boundary tag before block";
+    }
 
-    new_block->magic = ALLOC_MAGIC;
-    new_block->size = block->size - size - sizeof(Block) - sizeof(Footer);
-    new_block->free = true;
-    new_block->next = block->next;
-    new_block->prev = block;
-    new_block->is_mmap = false;
+    if(!problem) return true;
+    fprintf(stderr, "%s %p\n", problem, (void*)block);
+    assert(0);
+    return false;
+}
 
-    block->size = size;
-    block->next = new_block;
+// Merges a block that just became free with its free neighbours and puts the result in a bin.
+// The block must not be in a bin yet, arena lock held. Returns the merged block.
+Block *coalesce_blocks(Arena *arena, Block *block)
+{
+    size_t size = block_size(block);
+    Block *next = next_block(block);
+    bool zero = block->size & BLOCK_ZERO;
 
-    Footer *new_footer = get_Footer(new_block);
-    if(!new_footer)
+    //Merged zero blocks stay zero once the metadata that ends up inside the payload is cleared
+    if(block_is_free(next))
     {
-        fprintf(stderr, "Failed to get footer for new block at %p\n", (void*)new_block);
-        return;
+        bin_remove(arena, next);
+        zero = zero && (next->size & BLOCK_ZERO);
+        size += sizeof(Block) + block_size(next); // Before the header is cleared
+        if(zero) memset(next, 0, sizeof(Block) + ZERO_HEAD);
     }
-    new_footer->size = new_block->size;
 
-    Footer *block_footer = get_Footer(block);
-    if(!block_footer)
+    if(block->size & BLOCK_PREV_FREE)
     {
-        fprintf(stderr, "Failed to get footer for block at %p\n", (void*)block);
-        return;
+        Block *prev = prev_block(block);
+        bin_remove(arena, prev);
+        zero = zero && (prev->size & BLOCK_ZERO);
+        size += sizeof(Block) + block_size(prev);
+        if(zero) memset((char*)block - sizeof(Footer), 0, sizeof(Footer) + sizeof(Block));
+        block = prev;
     }
-    block_footer->size = block->size;
 
-    if (new_block->next) new_block->next->prev = new_block;
-    else tail = new_block;
+    block->size = size | BLOCK_FREE | (block->size & BLOCK_PREV_FREE) | (zero ? BLOCK_ZERO : 0);
+    block->magic = FREED_MAGIC;
+    block->arena = arena->index;
+    get_Footer(block)->size = size;
+    if(background && size >= STAMPED_SIZE) *free_stamp(block) = now_ms();
+    next_block(block)->size |= BLOCK_PREV_FREE;
+
+    bin_insert(arena, block);
+    return block;
 }
 
+// Radix map from 4 KiB page number to the region that starts on that page, so a
+// bare pointer can be traced back to its slab, large mapping or heap segment. Lookups are
+// lock-free, nodes are allocated on demand under pagemap_lock and never freed.
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_MASK (PAGEMAP_FANOUT - 1)
+#define PAGEMAP_SLAB 1UL  // Tags in the low bits of a map entry
+#define PAGEMAP_LARGE 2UL
+#define PAGEMAP_SEGMENT 3UL
+#define PAGEMAP_TAGS 3UL
+#define PAGEMAP_HUGETLB 4UL // Large mapping on explicit huge pages
+#define PAGEMAP_SAMPLED 8UL // Large mapping holding an object sampled by the heap profiler
 
+typedef struct PageMapNode {
+    void *slots[PAGEMAP_FANOUT];
+} PageMapNode;
 
-void* my_malloc(size_t size)
+static PageMapNode pagemap_root;
+static pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uintptr_t pagemap_get(const void *addr)
 {
-    pthread_mutex_lock(&alloc_mutex);
-    validate_heap(); // Validate the heap before allocation
-    Block *block;
-    if(size <= 0 || size > SIZE_MAX - sizeof(Block) - sizeof(Footer)) 
-    {
-        pthread_mutex_unlock(&alloc_mutex);
-        //fprintf(stderr,"Overflow or underflow in my_malloc with size %zu\n", size);
-        return NULL; //Invalid size
-    }
-    size_t  actual_size = ALIGN(size);
-    //size_t  total_size = sizeof(Block) + actual_size + sizeof(Footer);
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+    if(page >> (3 * PAGEMAP_LEVEL_BITS)) return 0;
 
-    block = find_best_fit(actual_size);
-    if(!block)
-    {
-        block = request_space(actual_size);
-        if(!block)  
-        {
-            pthread_mutex_unlock(&alloc_mutex);
-            return NULL;
-        }
-    }
-    else
-    {
-        if(block->size >= actual_size + MIN_BLOCK_SIZE) split(block, actual_size);
-        block->free = false; //Mark the block as used
-    }
-    validate_heap();
-    pthread_mutex_unlock(&alloc_mutex);
-    return (void*)((char*)block + sizeof(Block)); //Return a pointer to the memory after the block header
+    PageMapNode *mid = __atomic_load_n((PageMapNode**)&pagemap_root.slots[page >> (2 * PAGEMAP_LEVEL_BITS)], __ATOMIC_ACQUIRE);
+    if(!mid) return 0;
+    PageMapNode *leaf = __atomic_load_n((PageMapNode**)&mid->slots[(page >> PAGEMAP_LEVEL_BITS) & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+    if(!leaf) return 0;
+    return (uintptr_t)__atomic_load_n(&leaf->slots[page & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+static PageMapNode *pagemap_child(PageMapNode *node, size_t idx)
+{
+    PageMapNode *child = node->slots[idx];
+    if(child) return child;
 
+    child = mmap(NULL, sizeof(PageMapNode), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(child == MAP_FAILED) return NULL;
+    __atomic_store_n((PageMapNode**)&node->slots[idx], child, __ATOMIC_RELEASE);
+    return child;
 }
 
-void *my_calloc(size_t nmemb, size_t size)
+static bool pagemap_set(const void *addr, uintptr_t entry)
 {
-    if (nmemb == 0 || size == 0) return NULL;
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+    if(page >> (3 * PAGEMAP_LEVEL_BITS)) return false;
 
-    if (size > SIZE_MAX / nmemb) return NULL;
+    pthread_mutex_lock(&pagemap_lock);
+    PageMapNode *mid = pagemap_child(&pagemap_root, page >> (2 * PAGEMAP_LEVEL_BITS));
+    PageMapNode *leaf = mid ? pagemap_child(mid, (page >> PAGEMAP_LEVEL_BITS) & PAGEMAP_MASK) : NULL;
+    if(leaf) __atomic_store_n(&leaf->slots[page & PAGEMAP_MASK], (void*)entry, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pagemap_lock);
+    return leaf != NULL;
+}
 
-    size_t total_size = nmemb * size;
+// Returns the heap region holding ptr, or NULL if ptr is not in committed heap memory
+static HeapRegion *region_of(const void *ptr)
+{
+    uintptr_t entry = pagemap_get((void*)((uintptr_t)ptr & ~(uintptr_t)(SEGMENT_SIZE - 1)));
+    if((entry & PAGEMAP_TAGS) != PAGEMAP_SEGMENT) return NULL;
 
-    if (total_size > SIZE_MAX - sizeof(Block) - sizeof(Footer)) return NULL;
+    HeapRegion *region = (HeapRegion*)(entry & ~PAGEMAP_TAGS);
+    if((char*)ptr < (char*)region_first_block(region) + sizeof(Block) || (char*)ptr >= (char*)region + region->size) return NULL;
+    return region;
+}
 
-    void *ptr = my_malloc(total_size);
-    if (!ptr) return NULL;
+static void advise_huge(void *start, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+    madvise(start, len, MADV_HUGEPAGE);
+#else
+    (void)start;
+    (void)len;
+#endif
+}
 
-    memset(ptr, 0, total_size);
-    return ptr;
+// Reserves one SEGMENT_SIZE-aligned segment of address space without committing any of it
+static void *segment_reserve(void)
+{
+    char *raw = mmap(NULL, 2 * SEGMENT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(raw == MAP_FAILED) return NULL;
+
+    //Trim the reservation down to one aligned segment
+    char *base = (char*)(((uintptr_t)raw + SEGMENT_SIZE - 1) & ~(uintptr_t)(SEGMENT_SIZE - 1));
+    if(base > raw) munmap(raw, base - raw);
+    munmap(base + SEGMENT_SIZE, raw + SEGMENT_SIZE - base);
+    if(hugepages) advise_huge(base, SEGMENT_SIZE);
+    return base;
 }
 
-void coalesce_blocks(Block *block)
+static size_t segment_commit_size(void)
 {
-    validate_heap();
-    if(!block || !block->free || block->magic != FREED_MAGIC) return;
-    
-    if (block->prev && block->prev->free && 
-        (char*)block->prev + sizeof(Block) + block->prev->size == (char*)block) {
-        
-        block->prev->size += sizeof(Block) + block->size;
-        
-        Footer *foot = get_Footer(block->prev);
-        if (foot) foot->size = block->prev->size;
-        
-        block->prev->next = block->next;
-        if (block->next) block->next->prev = block->prev;
-        block = block->prev;
-    }
+    return hugepages ? HUGE_PAGE_SIZE : SEGMENT_COMMIT;
+}
+
+// Makes len reserved bytes at start usable, on explicit huge pages when asked to.
+// Sets *explicit_pages when it got them.
+static bool segment_commit(void *start, size_t len, bool *explicit_pages)
+{
+    *explicit_pages = false;
+#ifdef MAP_HUGETLB
+    if(hugepages == 2 && !__atomic_load_n(&hugetlb_unavailable, __ATOMIC_RELAXED))
+    {
+        if(mmap(start, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+        {
+            __atomic_add_fetch(&huge_explicit_bytes, len, __ATOMIC_RELAXED);
+            *explicit_pages = true;
+            return true;
+        }
+        __atomic_store_n(&hugetlb_unavailable, true, __ATOMIC_RELAXED);
 
-    
-    if (block->next && block->next->free &&
-        (char*)block + sizeof(Block) + block->size == (char*)block->next) {
-        
-        block->size += sizeof(Block) + block->next->size;
-        
-        Footer *foot = get_Footer(block);
-        if (foot) foot->size = block->size;
-        
-        block->next = block->next->next;
-        if (block->next) block->next->prev = block;
+        //A failed MAP_FIXED may already have dropped the reservation, so map the range afresh
+        if(mmap(start, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) return false;
+        advise_huge(start, len);
+        __atomic_add_fetch(&huge_advised_bytes, len, __ATOMIC_RELAXED);
+        return true;
+    }
+#endif
+    if(mprotect(start, len, PROT_READ | PROT_WRITE)) return false;
+    if(hugepages)
+    {
+        advise_huge(start, len); // Ranges that were trimmed and are committed again lost the advice
+        __atomic_add_fetch(&huge_advised_bytes, len, __ATOMIC_RELAXED);
     }
+    return true;
+}
 
-    validate_heap();
+// Settles the counters for the committed bytes of a region past from, which are going away
+static void region_uncount(HeapRegion *region, size_t from)
+{
+    size_t explicit_bytes = region->hugetlb_end > from ? region->hugetlb_end - from : 0;
+    __atomic_sub_fetch(&huge_explicit_bytes, explicit_bytes, __ATOMIC_RELAXED);
+    if(hugepages) __atomic_sub_fetch(&huge_advised_bytes, region->size - from - explicit_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trimmed_bytes, region->size - from, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&heap_committed, region->size - from, __ATOMIC_RELAXED);
+    if(region->hugetlb_end > from) region->hugetlb_end = from;
 }
 
+// Drops the committed bytes of a region past new_size and turns them back into bare
+// reservation. Returns false if the kernel refused.
+static bool region_decommit(HeapRegion *region, size_t new_size)
+{
+    char *start = (char*)region + new_size;
+    if(mmap(start, region->size - new_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) return false;
 
-Block *get_block_ptr(void *ptr) 
+    region_uncount(region, new_size);
+    region->size = new_size;
+    return true;
+}
+
+// Turns the first len bytes of a committed segment into a new region holding one
+// free block, arena lock held
+static Block *region_create(Arena *arena, void *start, size_t len)
 {
-  if(!ptr) return NULL;
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
-    //if(block->magic != ALLOC_MAGIC && block->magic != FREED_MAGIC) return NULL;
-    return block;
+    HeapRegion *region = start;
+    region->size = len;
+    region->reserved = SEGMENT_SIZE;
+    __atomic_add_fetch(&heap_reserved, SEGMENT_SIZE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heap_committed, len, __ATOMIC_RELAXED);
+    region->hugetlb_end = 0;
+    region->arena = arena->index;
+    region->next = arena->regions;
+    arena->regions = region;
+
+    Block *fencepost = region_fencepost(region);
+    fencepost->size = 0;
+    fencepost->magic = ALLOC_MAGIC;
+    fencepost->arena = arena->index;
+
+    Block *block = region_first_block(region);
+    block->size = ((char*)fencepost - (char*)block - sizeof(Block)) | BLOCK_ZERO;
+    return coalesce_blocks(arena, block);
 }
 
-void my_free(void* ptr)
+// Grows the arena by at least size payload bytes and returns the new free block, which sits in a bin
+Block *request_space(Arena *arena, size_t size)
 {
-    pthread_mutex_lock(&alloc_mutex);
-    validate_heap(); // Validate the heap before freeing
-    if(!ptr) 
-    {
-        pthread_mutex_unlock(&alloc_mutex);
-        return; //Invalid posize_ter
-    }
+    size_t commit = segment_commit_size();
+    size_t request_size = ((size + 2 * sizeof(Block) + commit - 1) / commit) * commit;
+
+    bool explicit_pages;
 
-    Block *block_ptr = get_block_ptr(ptr);
-    if(!block_ptr || (block_ptr->magic != ALLOC_MAGIC && block_ptr->magic != FREED_MAGIC)) 
+    HeapRegion *top = arena->top;
+    if(top && top->reserved - top->size >= request_size && segment_commit((char*)top + top->size, request_size, &explicit_pages))
     {
-        pthread_mutex_unlock(&alloc_mutex);
-        return;
+        //A tail trimmed on free was needed again, keep more of it from now on
+        if(arena->top_trimmed)
+        {
+            size_t pad = 2 * arena->trim_pad > request_size ? 2 * arena->trim_pad : request_size;
+            arena->trim_pad = pad < TRIM_PAD_MAX ? pad : TRIM_PAD_MAX;
+            arena->top_trimmed = false;
+        }
+
+        //Commit the next stretch of the segment, the old fencepost heads the new space
+        Block *block = region_fencepost(top);
+        top->size += request_size;
+        __atomic_add_fetch(&heap_committed, request_size, __ATOMIC_RELAXED);
+        if(explicit_pages) top->hugetlb_end = top->size;
+
+        Block *fencepost = region_fencepost(top);
+        fencepost->size = 0;
+        fencepost->magic = ALLOC_MAGIC;
+        fencepost->arena = arena->index;
+
+        block->size = (block->size & BLOCK_PREV_FREE) | (request_size - sizeof(Block)) | BLOCK_ZERO;
+        return coalesce_blocks(arena, block);
     }
 
-    if(block_ptr->free) 
+    //The top segment is full, start a new one. The rest of the old one stays reserved.
+    request_size = ((size + ALIGN(sizeof(HeapRegion)) + 2 * sizeof(Block) + commit - 1) / commit) * commit;
+    if(request_size > SEGMENT_SIZE) return NULL;
+
+    void *segment = segment_reserve();
+    if(!segment) return NULL;
+    if(!segment_commit(segment, request_size, &explicit_pages) || !pagemap_set(segment, (uintptr_t)segment | PAGEMAP_SEGMENT))
     {
-        pthread_mutex_unlock(&alloc_mutex);
-        return;
+        munmap(segment, SEGMENT_SIZE);
+        return NULL;
     }
-    
 
-    if(block_ptr->is_mmap) 
-    {
-        block_ptr->magic = FREED_MAGIC;
+    Block *block = region_create(arena, segment, request_size);
+    arena->top = arena->regions;
+    if(explicit_pages) arena->top->hugetlb_end = request_size;
+    return block;
+}
 
-        // Remove the block from the linked list
-        if (block_ptr->prev) block_ptr->prev->next = block_ptr->next;
-        else head = block_ptr->next;
+// Gives the committed tail of a region that ends in a free block back to the kernel,
+// keeping pad bytes of that block. Returns the bytes released, arena lock held.
+static size_t region_trim(Arena *arena, HeapRegion *region, size_t pad)
+{
+    Block *fencepost = region_fencepost(region);
+    if(!(fencepost->size & BLOCK_PREV_FREE)) return 0;
 
-        if (block_ptr->next) block_ptr->next->prev = block_ptr->prev;
-        else tail = block_ptr->prev;
+    Block *last = prev_block(fencepost);
+    size_t commit = segment_commit_size();
+    size_t keep = pad < ALIGN(MIN_PAYLOAD) ? ALIGN(MIN_PAYLOAD) : ALIGN(pad);
+    size_t new_size = (char*)last - (char*)region + 2 * sizeof(Block) + keep;
+    new_size = ((new_size + commit - 1) / commit) * commit;
 
-        //Unmap the memory
-        munmap(block_ptr, block_ptr->size + sizeof(Block) + sizeof(Footer));
-    
-        pthread_mutex_unlock(&alloc_mutex);
-        return;
-    }
-   block_ptr->magic = FREED_MAGIC;
-    block_ptr->free = true;
-    coalesce_blocks(block_ptr);
+    size_t old_size = region->size;
+    if(new_size >= old_size || !region_decommit(region, new_size)) return 0;
+
+    //The last block now ends at a new fencepost inside the committed part
+    bin_remove(arena, last);
+    fencepost = region_fencepost(region);
+    fencepost->size = BLOCK_PREV_FREE;
+    fencepost->magic = ALLOC_MAGIC;
+    fencepost->arena = arena->index;
 
-    validate_heap();
-    pthread_mutex_unlock(&alloc_mutex);
+    last->size = ((char*)fencepost - (char*)last - sizeof(Block)) | BLOCK_FREE | (last->size & BLOCK_PREV_FREE);
+    get_Footer(last)->size = block_size(last);
+    bin_insert(arena, last);
+    return old_size - new_size;
 }
 
+// Unmaps the segment of a region that is one free block, arena lock held
+static size_t region_release(Arena *arena, HeapRegion *region)
+{
+    size_t size = region->size;
+
+    bin_remove(arena, region_first_block(region));
+    for(HeapRegion **link = &arena->regions; *link; link = &(*link)->next)
+    {
+        if(*link != region) continue;
+        *link = region->next;
+        break;
+    }
+
+    pagemap_set(region, 0);
+    region_uncount(region, 0);
+    __atomic_sub_fetch(&heap_reserved, region->reserved, __ATOMIC_RELAXED);
+    munmap(region, region->reserved);
+    return size;
+}
 
-void *my_realloc(void *ptr, size_t size) 
+// Bytes of the page-aligned range [start, end) that are backed by memory. A block that
+// was purged, split and merged again keeps pages that were never touched since, and
+// purging it again must not count those twice.
+static size_t resident_bytes(char *start, char *end)
 {
-    if (!ptr) return my_malloc(size);
-    if (!size)
-    { 
-        my_free(ptr); 
-        return NULL; 
+    size_t page = 1UL << PAGEMAP_SHIFT;
+    unsigned char vec[512];
+    size_t bytes = 0;
+
+    while(start < end)
+    {
+        size_t len = (size_t)(end - start) < sizeof(vec) * page ? (size_t)(end - start) : sizeof(vec) * page;
+        if(mincore(start, len, vec)) return bytes + (end - start); // Count what cannot be checked
+        for(size_t i = 0; i < len / page; i++) bytes += vec[i] & 1 ? page : 0;
+        start += len;
     }
+    return bytes;
+}
 
-    Block *old_block = get_block_ptr(ptr);
-    size_t old_size = old_block->size;
+// Drops the pages of a free block that lie between from and to, leaving its links,
+// stamp and footer in place. The pages read back as zero. Returns the resident bytes
+// dropped, nothing when none of them were.
+static size_t purge_pages(Block *block, char *from, char *to)
+{
+    size_t granule = hugepages ? HUGE_PAGE_SIZE : 1UL << PAGEMAP_SHIFT;
+    char *lo = (char*)(free_stamp(block) + 1);
+    char *hi = (char*)get_Footer(block);
 
-    void *new_ptr = my_malloc(size);
-    if (!new_ptr) return NULL;
-    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
-    my_free(ptr);
-    return new_ptr;
+    if(from < lo) from = lo;
+    if(to > hi) to = hi;
+    from = (char*)(((uintptr_t)from + granule - 1) & ~(uintptr_t)(granule - 1));
+    to = (char*)((uintptr_t)to & ~(uintptr_t)(granule - 1));
+    if(to <= from) return 0;
+
+    size_t resident = resident_bytes(from, to);
+    if(!resident || madvise(from, to - from, MADV_DONTNEED)) return 0;
+
+    __atomic_add_fetch(&purged_bytes, resident, __ATOMIC_RELAXED);
+    return resident;
 }
 
+// Returns memory around a block freed from [from, to) to the kernel once it has been
+// merged into block, arena lock held
+static void release_free_memory(Arena *arena, Block *block, char *from, char *to)
+{
+    if(background) return; // The decay thread will get to it
 
+    HeapRegion *region = region_of(block + 1);
 
-// Function to print memory statistics
-void print_memory_stats() {
-    size_t total = 0, used_payload = 0, used_total = 0;
-    size_t blocks = 0, mmap_blocks = 0;
-    
-    Block* curr = head;
-    while (curr) {
-        size_t block_total = sizeof(Block) + curr->size + sizeof(Footer);
-        total += block_total;
-        if (!curr->free) {
-            used_payload += curr->size;
-            used_total += block_total;
-        }
-        blocks++;
-        if (curr->is_mmap) mmap_blocks++;
-        curr = curr->next;
+    if(next_block(block) == region_fencepost(region))
+    {
+        if(block == region_first_block(region) && region != arena->top)
+        {
+            region_release(arena, region);
+            return;
+        }
+        if(trim_threshold && block_size(block) >= trim_threshold && region_trim(arena, region, arena->trim_pad))
+        {
+            if(region == arena->top) arena->top_trimmed = true;
+            return;
+        }
+    }
+    if(purge_threshold && (size_t)(to - from) >= purge_threshold) purge_pages(block, from, to);
+}
+
+// Gives everything past size bytes of a used block back to the bins, arena lock held.
+// The tail stays known-zero if the block was.
+void split(Arena *arena, Block *block, size_t size)
+{
+    if(block_size(block) < size + MIN_BLOCK_SIZE) return;
+
+    size_t remaining_size = block_size(block) - size - sizeof(Block);
+    block->size = size | (block->size & BLOCK_FLAGS);
+
+    Block *new_block = next_block(block);
+    new_block->size = remaining_size | (block->size & BLOCK_ZERO);
+    new_block->arena = block->arena;
+    coalesce_blocks(arena, new_block);
+}
+
+// Takes a free block out of its bin and hands out size bytes of it, arena lock held
+static void take_block(Arena *arena, Block *block, size_t size)
+{
+    bin_remove(arena, block);
+    block->size &= ~BLOCK_FREE;
+    block->magic = ALLOC_MAGIC;
+    next_block(block)->size &= ~BLOCK_PREV_FREE;
+    split(arena, block, size);
+}
+
+// Returns the slab holding ptr, or NULL if ptr does not point into a slab
+static Slab *slab_of(const void *ptr)
+{
+    uintptr_t entry = pagemap_get((void*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1)));
+    if((entry & PAGEMAP_TAGS) != PAGEMAP_SLAB) return NULL;
+    return (Slab*)(entry & ~PAGEMAP_TAGS);
+}
+
+// Returns the header of the large mapping ptr was handed out from, or NULL. The
+// header sits in the first page of its mapping, which is where it is registered.
+static Block *large_of(const void *ptr)
+{
+    Block *block = (Block*)((char*)ptr - sizeof(Block));
+    uintptr_t entry = pagemap_get(block);
+    if((entry & PAGEMAP_TAGS) != PAGEMAP_LARGE || (Block*)(entry & ~(PAGEMAP_TAGS | PAGEMAP_HUGETLB | PAGEMAP_SAMPLED)) != block) return NULL;
+    return block;
+}
+
+static size_t slab_class(size_t size)
+{
+    return (size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size) / ALIGNMENT;
+}
+
+static void slab_list_insert(Arena *arena, Slab *slab)
+{
+    size_t cls = slab->obj_size / ALIGNMENT;
+
+    slab->prev = NULL;
+    slab->next = arena->slabs[cls];
+    if(slab->next) slab->next->prev = slab;
+    arena->slabs[cls] = slab;
+}
+
+static void slab_list_remove(Arena *arena, Slab *slab)
+{
+    size_t cls = slab->obj_size / ALIGNMENT;
+
+    if(slab->prev) slab->prev->next = slab->next;
+    else arena->slabs[cls] = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+// Maps a fresh SLAB_SIZE-aligned slab for one class, arena lock held
+static Slab *slab_create(Arena *arena, size_t obj_size)
+{
+    char *raw = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) return NULL;
+
+    //Trim the mapping down to one aligned slab
+    char *base = (char*)(((uintptr_t)raw + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if(base > raw) munmap(raw, base - raw);
+    munmap(base + SLAB_SIZE, raw + SLAB_SIZE - base);
+
+    Slab *slab = (Slab*)base;
+    size_t max_slots = SLAB_SIZE / obj_size;
+    size_t words = (max_slots + 63) / 64;
+    size_t header = ALIGN(sizeof(Slab) + words * sizeof(uint64_t));
+
+    slab->magic = SLAB_MAGIC;
+    slab->arena = arena->index;
+    slab->obj_size = obj_size;
+    slab->capacity = (unsigned)((SLAB_SIZE - header) / obj_size);
+    slab->used = 0;
+    slab->hint = 0;
+    slab->objects = base + header;
+
+    //Slots past the capacity are marked used so the bitmap scan never hands them out
+    for(size_t i = slab->capacity; i < words * 64; i++) slab->bitmap[i / 64] |= 1UL << (i % 64);
+
+    if(!pagemap_set(slab, (uintptr_t)slab | PAGEMAP_SLAB))
+    {
+        munmap(slab, SLAB_SIZE);
+        return NULL;
+    }
+    slab_list_insert(arena, slab);
+    arena->slab_count++;
+    __atomic_add_fetch(&slab_mapped, SLAB_SIZE, __ATOMIC_RELAXED);
+    return slab;
+}
+
+static void slab_destroy(Arena *arena, Slab *slab)
+{
+    slab_list_remove(arena, slab);
+    pagemap_set(slab, 0);
+    arena->slab_count--;
+    __atomic_sub_fetch(&slab_mapped, SLAB_SIZE, __ATOMIC_RELAXED);
+    munmap(slab, SLAB_SIZE);
+}
+
+// Hands out one slot of the given class, arena lock held
+static void *slab_alloc(Arena *arena, size_t cls)
+{
+    Slab *slab = arena->slabs[cls];
+    if(!slab && !(slab = slab_create(arena, cls * ALIGNMENT))) return NULL;
+
+    size_t words = (slab->capacity + 63) / 64;
+    for(size_t w = slab->hint; w < words; w++)
+    {
+        if(slab->bitmap[w] == ~0UL) continue;
+
+        size_t bit = __builtin_ctzl(~slab->bitmap[w]);
+        slab->bitmap[w] |= 1UL << bit;
+        slab->hint = (unsigned)w;
+        if(++slab->used == slab->capacity) slab_list_remove(arena, slab);
+        arena->slab_used_bytes += slab->obj_size;
+        return slab->objects + (w * 64 + bit) * slab->obj_size;
+    }
+
+    fprintf(stderr, "Slab %p listed as free but has no free slot\n", (void*)slab);
+    return NULL;
+}
+
+// Returns a slot to its slab, arena lock held. Pointers that are not the start of a used slot are ignored.
+static void slab_free(Arena *arena, Slab *slab, void *ptr)
+{
+    size_t offset = (char*)ptr - slab->objects;
+    size_t slot = offset / slab->obj_size;
+
+    if((char*)ptr < slab->objects || offset % slab->obj_size || slot >= slab->capacity) return;
+    if(!(slab->bitmap[slot / 64] & (1UL << (slot % 64)))) return; // Double free
+
+    slab->bitmap[slot / 64] &= ~(1UL << (slot % 64));
+    if(slot / 64 < slab->hint) slab->hint = (unsigned)(slot / 64);
+    if(slab->used-- == slab->capacity) slab_list_insert(arena, slab);
+    arena->slab_used_bytes -= slab->obj_size;
+
+    //Keep one empty slab per class around, give the others back
+    if(!slab->used && (slab->next || slab->prev)) slab_destroy(arena, slab);
+}
+
+// Reads a numeric tuning knob from the environment, keeping the default when unset or malformed
+static size_t env_option(const char *name, size_t def)
+{
+    const char *value = getenv(name);
+    char *end;
+
+    if(!value || !*value) return def;
+    unsigned long long parsed = strtoull(value, &end, 0);
+    return *end ? def : (size_t)parsed;
+}
+
+static int trace_open(const char *path);
+
+static void init_options(void)
+{
+    validate_level = env_option("MALLOCATOR_VALIDATE", MALLOCATOR_VALIDATE);
+    if(validate_level > 3) validate_level = 3;
+
+    slab_cutoff = env_option("MALLOCATOR_SLAB_CUTOFF", SLAB_CUTOFF);
+    if(slab_cutoff > SLAB_MAX_CUTOFF) slab_cutoff = SLAB_MAX_CUTOFF;
+    best_fit = env_option("MALLOCATOR_BEST_FIT", 0) != 0;
+    if(best_fit) slab_cutoff = 0;
+
+    mmap_threshold_min = env_option("MALLOCATOR_MMAP_THRESHOLD_MIN", MMAP_THRESHOLD);
+    if(mmap_threshold_min < 4096) mmap_threshold_min = 4096;
+    mmap_threshold_max = env_option("MALLOCATOR_MMAP_THRESHOLD_MAX", MMAP_THRESHOLD_MAX);
+    if(mmap_threshold_max > SEGMENT_SIZE / 2) mmap_threshold_max = SEGMENT_SIZE / 2; // Heap requests must fit a fresh segment
+    if(mmap_threshold_max < mmap_threshold_min) mmap_threshold_max = mmap_threshold_min;
+    __atomic_store_n(&mmap_threshold, mmap_threshold_min, __ATOMIC_RELAXED);
+
+    trim_threshold = env_option("MALLOCATOR_TRIM_THRESHOLD", TRIM_THRESHOLD);
+    purge_threshold = env_option("MALLOCATOR_PURGE_THRESHOLD", PURGE_THRESHOLD);
+
+    background = env_option("MALLOCATOR_BACKGROUND", 0) != 0;
+    decay_ms = env_option("MALLOCATOR_DECAY_MS", MALLOCATOR_DECAY_MS);
+
+    hugepages = env_option("MALLOCATOR_HUGEPAGES", MALLOCATOR_HUGEPAGES);
+    if(hugepages > 2) hugepages = 2;
+
+    mapcache_limit = env_option("MALLOCATOR_MAPCACHE", MAPCACHE_LIMIT);
+    mapcache_decay_ms = env_option("MALLOCATOR_MAPCACHE_DECAY_MS", MAPCACHE_DECAY_MS);
+
+    if(env_option("MALLOCATOR_LATENCY", 0)) hooks |= HOOK_LATENCY;
+    profile_rate = env_option("MALLOCATOR_PROFILE_RATE", 0);
+    if(profile_rate) hooks |= HOOK_PROFILE;
+
+    const char *trace_path = getenv("MALLOCATOR_TRACE");
+    if(trace_path && *trace_path) trace_open(trace_path);
+}
+
+static pthread_once_t options_once = PTHREAD_ONCE_INIT;
+
+static void arena_init(Arena *arena, unsigned index)
+{
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->index = index;
+    arena->trim_pad = TRIM_PAD;
+    //Published last, threads that walk the arenas without arenas_lock check it first
+    __atomic_store_n(&arena->initialized, true, __ATOMIC_RELEASE);
+}
+
+// Attaches a new thread to the arena with the fewest attached threads
+static Arena *arena_attach(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+    if(!narenas)
+    {
+        pthread_once(&options_once, init_options);
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        narenas = cpus > 0 ? (unsigned)cpus * ARENAS_PER_CPU : 1;
+        if(narenas > MAX_ARENAS) narenas = MAX_ARENAS;
+    }
+
+    Arena *best = NULL;
+    for(unsigned i = 0; i < narenas; i++)
+    {
+        Arena *arena = &arenas[(next_arena + i) % narenas];
+        if(!best || arena->threads < best->threads) best = arena;
+        if(!best->threads) break;
+    }
+    unsigned index = (unsigned)(best - arenas);
+    next_arena = (index + 1) % narenas;
+
+    if(!best->initialized) arena_init(best, index);
+    best->threads++;
+    pthread_mutex_unlock(&arenas_lock);
+    return best;
+}
+
+static void arena_detach(Arena *arena)
+{
+    pthread_mutex_lock(&arenas_lock);
+    arena->threads--;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+static void release_block(Arena *arena, Block *block_ptr);
+Block *get_block_ptr(void *ptr);
+
+// Per-thread caches of recently freed small chunks, one LIFO list per ALIGNMENT step.
+// Cached chunks stay marked as used in their slab or arena, so a malloc/free pair
+// that hits the cache never takes an arena lock. Cache misses and overflows move
+// chunks in batches under a single lock acquisition.
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_BIN_CAP 32 // Chunks kept per class before half of them are flushed
+#define TCACHE_BATCH 16   // Chunks moved per refill or flush
+
+// Lives in the payload of a cached chunk. The key marks the chunk as cached so a
+// double free can be caught without touching a header.
+typedef struct TcacheEntry {
+    struct TcacheEntry* next;
+    uintptr_t key;
+} TcacheEntry;
+
+// Operation counters of one thread. Only the owning thread writes them, readers sum
+// every thread's set with relaxed loads, so counting costs no locked instruction.
+typedef struct ThreadStats {
+    size_t allocs[MY_STAT_CLASSES];
+    size_t frees[MY_STAT_CLASSES];
+    size_t mmap_allocs;
+    size_t mmap_frees;
+    size_t allocated_bytes; // Usable bytes handed out, cumulative
+    size_t freed_bytes;     // Usable bytes given back, cumulative
+    struct ThreadStats *next;
+    struct ThreadStats *prev;
+} ThreadStats;
+
+#define STAT_WORDS (offsetof(ThreadStats, next) / sizeof(size_t)) // Counters in front of the links
+
+typedef struct ThreadCache {
+    TcacheEntry* bins[TCACHE_BINS];
+    unsigned counts[TCACHE_BINS];
+    Arena *arena;    // Arena this thread allocates from
+    bool registered; // Exit destructor installed for this thread
+    bool shutdown;   // Exit destructor already ran, bypass the cache
+    ThreadStats stats;
+    struct LatencyHist *latency; // Timing histograms, once timing is on
+    size_t sample_countdown;     // Bytes left until the next heap profile sample
+    uint64_t sample_rng;         // Sampling state, 0 until this thread's first sample draw
+    struct TraceBuffer *trace;   // Trace ring, once this thread made a traced call
+    bool trace_nested;           // Inside a traced call, inner calls are not recorded
+} ThreadCache;
+
+static _Thread_local ThreadCache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static uintptr_t tcache_cookie;
+
+// Registered threads' counters, plus the folded counters of threads that exited. The
+// lock only guards the list, taken when a thread starts or exits and by readers.
+static ThreadStats *stats_threads;
+static ThreadStats retired_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tcache_push(ThreadCache *cache, size_t idx, void *ptr)
+{
+    TcacheEntry *entry = ptr;
+
+    entry->key = tcache_cookie;
+    entry->next = cache->bins[idx];
+    cache->bins[idx] = entry;
+    cache->counts[idx]++;
+}
+
+static void *tcache_pop(ThreadCache *cache, size_t idx)
+{
+    TcacheEntry *entry = cache->bins[idx];
+    if(!entry) return NULL;
+
+    cache->bins[idx] = entry->next;
+    cache->counts[idx]--;
+    entry->next = NULL;
+    entry->key = 0;
+    return entry;
+}
+
+// True if ptr already sits in this thread's cache
+static bool tcache_contains(ThreadCache *cache, size_t idx, void *ptr)
+{
+    if(((TcacheEntry*)ptr)->key != tcache_cookie) return false;
+
+    for(TcacheEntry *entry = cache->bins[idx]; entry; entry = entry->next)
+    {
+        if(entry == ptr) return true;
+    }
+    return false;
+}
+
+// Returns a used chunk to its slab or arena, owner's lock held
+static void release_chunk(Arena *owner, Slab *slab, void *ptr)
+{
+    if(slab) slab_free(owner, slab, ptr);
+    else if(!validate_level || check_block(get_block_ptr(ptr), false)) release_block(owner, get_block_ptr(ptr));
+}
+
+static Arena *chunk_owner(Slab *slab, void *ptr)
+{
+    return &arenas[slab ? slab->arena : get_block_ptr(ptr)->arena];
+}
+
+// Hands up to count cached chunks of one class back to their owners, locking each arena once per run
+static void tcache_flush(ThreadCache *cache, size_t idx, unsigned count)
+{
+    Arena *locked = NULL;
+    void *ptr;
+
+    while(count-- && (ptr = tcache_pop(cache, idx)))
+    {
+        Slab *slab = slab_of(ptr);
+        Arena *owner = chunk_owner(slab, ptr);
+        if(owner != locked)
+        {
+            if(locked) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&owner->lock);
+            locked = owner;
+        }
+        release_chunk(owner, slab, ptr);
+    }
+    if(locked) pthread_mutex_unlock(&locked->lock);
+}
+
+struct LatencyHist;
+static void latency_retire(struct LatencyHist *hist);
+static void profile_forget(Block *block);
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread ring of trace events, see the allocation tracing further down
+#define TRACE_EVENTS 4096 // Events per thread ring, a power of two
+
+typedef struct TraceBuffer {
+    size_t head;          // Next event to write, owner only
+    size_t tail;          // Next event to flush
+    pthread_mutex_t lock; // Serializes flushes
+    uint32_t thread;
+    struct TraceBuffer *next;
+    struct TraceBuffer *prev;
+    MyTraceEvent events[TRACE_EVENTS];
+} TraceBuffer;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_threads; // On trace_lock, like start and stop
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static uint32_t trace_thread_ids;
+static void trace_retire(TraceBuffer *buf);
+
+// Adds a thread's counters to the retired set and drops it from the list, all under
+// the list lock so a reader sees them exactly once
+static void stats_retire(ThreadStats *stats)
+{
+    size_t *from = (size_t*)stats, *to = (size_t*)&retired_stats;
+
+    pthread_mutex_lock(&stats_lock);
+    for(size_t i = 0; i < STAT_WORDS; i++)
+    {
+        __atomic_add_fetch(&to[i], from[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&from[i], 0, __ATOMIC_RELAXED);
+    }
+    if(stats->prev) stats->prev->next = stats->next;
+    else stats_threads = stats->next;
+    if(stats->next) stats->next->prev = stats->prev;
+    stats->next = stats->prev = NULL;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Returns the whole cache to the arenas and detaches from the arena when its thread exits
+static void tcache_destroy(void *arg)
+{
+    ThreadCache *cache = arg;
+
+    for(size_t idx = 0; idx < TCACHE_BINS; idx++) tcache_flush(cache, idx, cache->counts[idx]);
+    if(cache->arena) arena_detach(cache->arena);
+    stats_retire(&cache->stats);
+    if(cache->latency) latency_retire(cache->latency);
+    if(cache->trace) trace_retire(cache->trace);
+    cache->latency = NULL;
+    cache->trace = NULL;
+    cache->arena = NULL;
+    cache->shutdown = true;
+}
+
+static void tcache_create_key(void)
+{
+    int local;
+
+    pthread_key_create(&tcache_key, tcache_destroy);
+    tcache_cookie = ((uintptr_t)&local ^ (uintptr_t)time(NULL) * 0x9E3779B97F4A7C15UL) | 1;
+}
+
+static void tcache_register(void)
+{
+    pthread_once(&tcache_key_once, tcache_create_key);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+
+    pthread_mutex_lock(&stats_lock);
+    tcache.stats.next = stats_threads;
+    if(stats_threads) stats_threads->prev = &tcache.stats;
+    stats_threads = &tcache.stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Counters of the calling thread. Threads past their exit destructor share the retired set.
+static ThreadStats *thread_stats(void)
+{
+    if(tcache.shutdown) return &retired_stats;
+    if(!tcache.registered) tcache_register();
+    return &tcache.stats;
+}
+
+static void stat_add(ThreadStats *stats, size_t *counter, size_t n)
+{
+    if(stats == &retired_stats) __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+    else __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED); // Single writer
+}
+
+// Class 0 counts sizes up to 16 bytes, class i up to 16 << i, the last one the rest
+static size_t stat_class(size_t size)
+{
+    if(size <= 16) return 0;
+    size_t cls = (size_t)(64 - __builtin_clzl(size - 1)) - 4;
+    return cls < MY_STAT_CLASSES ? cls : MY_STAT_CLASSES - 1;
+}
+
+// Thread cache hits and pushes only happen on registered, live threads, so they skip
+// the checks in thread_stats() and count with plain stores
+static void stats_cached(size_t *counts, size_t usable, size_t *bytes)
+{
+    size_t cls = stat_class(usable);
+    __atomic_store_n(&counts[cls], counts[cls] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(bytes, *bytes + usable, __ATOMIC_RELAXED);
+}
+
+static void stats_alloc(size_t usable, bool mapped)
+{
+    ThreadStats *stats = thread_stats();
+    stat_add(stats, &stats->allocs[stat_class(usable)], 1);
+    stat_add(stats, &stats->allocated_bytes, usable);
+    if(mapped) stat_add(stats, &stats->mmap_allocs, 1);
+}
+
+static void stats_free(size_t usable, bool mapped)
+{
+    ThreadStats *stats = thread_stats();
+    stat_add(stats, &stats->frees[stat_class(usable)], 1);
+    stat_add(stats, &stats->freed_bytes, usable);
+    if(mapped) stat_add(stats, &stats->mmap_frees, 1);
+}
+
+// A block that changed size in place, counted as bytes only
+static void stats_resize(size_t old_usable, size_t new_usable)
+{
+    ThreadStats *stats = thread_stats();
+    stat_add(stats, &stats->allocated_bytes, new_usable);
+    stat_add(stats, &stats->freed_bytes, old_usable);
+}
+
+static pthread_once_t decay_once = PTHREAD_ONCE_INIT;
+static void decay_start(void);
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static void atfork_register(void);
+
+static Arena *thread_arena(void)
+{
+    if(!tcache.arena)
+    {
+        if(!tcache.registered && !tcache.shutdown) tcache_register();
+        tcache.arena = arena_attach();
+        //A thread that allocates during its own exit is not tracked any more, keep it off the balance
+        if(tcache.shutdown) arena_detach(tcache.arena);
+        //Started once this thread has an arena, so allocations made by pthread_create find it
+        if(background) pthread_once(&decay_once, decay_start);
+        pthread_once(&atfork_once, atfork_register);
+    }
+    return tcache.arena;
+}
+
+// Stashes free blocks that exactly match a cached class into this thread's cache, arena lock held
+static void tcache_refill_locked(Arena *arena, size_t idx)
+{
+    size_t size = idx * ALIGNMENT;
+    unsigned steps = 2 * TCACHE_BATCH; // Only the top of a mixed-size bin is worth looking at
+
+    if(tcache.shutdown) return;
+
+    Block *current = arena->bins[bin_index(size)];
+    while(current && steps-- && tcache.counts[idx] < TCACHE_BATCH)
+    {
+        Block *next = free_links(current)->next_free;
+        if(block_size(current) == size)
+        {
+            take_block(arena, current, size);
+            tcache_push(&tcache, idx, (char*)current + sizeof(Block));
+        }
+        current = next;
+    }
+}
+
+// Pre-fills this thread's cache with slots of the same class, arena lock held
+static void tcache_refill_slab_locked(Arena *arena, size_t cls)
+{
+    if(tcache.shutdown || best_fit || cls * ALIGNMENT > TCACHE_MAX_SIZE) return;
+
+    while(tcache.counts[cls] < TCACHE_BATCH / 2 && arena->slabs[cls])
+    {
+        tcache_push(&tcache, cls, slab_alloc(arena, cls));
+    }
+}
+
+// A cached mapping keeps its freed header, the links live in the payload
+typedef struct CachedMapping {
+    struct CachedMapping *next;  // Same page count, most recently cached first
+    struct CachedMapping *prev;
+    struct CachedMapping *newer; // Whole cache in release order
+    struct CachedMapping *older;
+    size_t pages;
+    uint64_t released; // Milliseconds, monotonic
+} CachedMapping;
+
+static CachedMapping *mapcache_buckets[MAPCACHE_MAX_PAGES + 1];
+static CachedMapping *mapcache_oldest;
+static CachedMapping *mapcache_newest;
+static size_t mapcache_bytes;
+static size_t mapcache_hits;
+static pthread_mutex_t mapcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t map_pages(size_t len)
+{
+    return (len + (1UL << PAGEMAP_SHIFT) - 1) >> PAGEMAP_SHIFT;
+}
+
+static CachedMapping *cached_mapping(Block *block)
+{
+    return (CachedMapping*)((char*)block + sizeof(Block));
+}
+
+// Takes a mapping out of both lists, mapcache_lock held
+static void mapcache_unlink(CachedMapping *m)
+{
+    if(m->prev) m->prev->next = m->next;
+    else mapcache_buckets[m->pages] = m->next;
+    if(m->next) m->next->prev = m->prev;
+
+    if(m->older) m->older->newer = m->newer;
+    else mapcache_oldest = m->newer;
+    if(m->newer) m->newer->older = m->older;
+    else mapcache_newest = m->older;
+
+    mapcache_bytes -= m->pages << PAGEMAP_SHIFT;
+}
+
+// Unlinks mappings that are over limit or too old, mapcache_lock held. They are
+// chained through next and unmapped by mapcache_release once the lock is dropped.
+static CachedMapping *mapcache_expire(uint64_t now, size_t limit)
+{
+    CachedMapping *victims = NULL;
+    while(mapcache_oldest && (mapcache_bytes > limit || now - mapcache_oldest->released >= mapcache_decay_ms))
+    {
+        CachedMapping *m = mapcache_oldest;
+        mapcache_unlink(m);
+        m->next = victims;
+        victims = m;
+    }
+    return victims;
+}
+
+static void mapcache_release(CachedMapping *victims)
+{
+    while(victims)
+    {
+        CachedMapping *next = victims->next;
+        munmap((char*)victims - sizeof(Block), victims->pages << PAGEMAP_SHIFT);
+        victims = next;
+    }
+}
+
+// Unmaps every cached mapping and returns the bytes released
+static size_t mapcache_flush(void)
+{
+    pthread_mutex_lock(&mapcache_lock);
+    size_t bytes = mapcache_bytes;
+    CachedMapping *victims = mapcache_expire(now_ms(), 0);
+    pthread_mutex_unlock(&mapcache_lock);
+
+    mapcache_release(victims);
+    return bytes;
+}
+
+// Returns a cached mapping of exactly this many pages, or NULL
+static Block *mapcache_take(size_t pages)
+{
+    if(pages > MAPCACHE_MAX_PAGES || !__atomic_load_n(&mapcache_buckets[pages], __ATOMIC_RELAXED)) return NULL;
+
+    pthread_mutex_lock(&mapcache_lock);
+    CachedMapping *m = mapcache_buckets[pages];
+    if(m) mapcache_unlink(m);
+    CachedMapping *victims = mapcache_expire(now_ms(), mapcache_limit);
+    pthread_mutex_unlock(&mapcache_lock);
+
+    mapcache_release(victims);
+    if(!m) return NULL;
+    __atomic_add_fetch(&mapcache_hits, 1, __ATOMIC_RELAXED);
+    return (Block*)((char*)m - sizeof(Block));
+}
+
+// Keeps a freed mapping for reuse. Returns false if it does not fit in the cache.
+static bool mapcache_put(Block *block, size_t pages)
+{
+    if(pages > MAPCACHE_MAX_PAGES || (pages << PAGEMAP_SHIFT) > mapcache_limit) return false;
+
+    CachedMapping *m = cached_mapping(block);
+    m->pages = pages;
+    m->released = now_ms();
+    m->older = NULL;
+    m->prev = NULL;
+
+    pthread_mutex_lock(&mapcache_lock);
+    m->next = mapcache_buckets[pages];
+    if(m->next) m->next->prev = m;
+    __atomic_store_n(&mapcache_buckets[pages], m, __ATOMIC_RELAXED);
+    m->newer = NULL;
+    m->older = mapcache_newest;
+    if(mapcache_newest) mapcache_newest->newer = m;
+    else mapcache_oldest = m;
+    mapcache_newest = m;
+    mapcache_bytes += pages << PAGEMAP_SHIFT;
+    CachedMapping *victims = mapcache_expire(m->released, mapcache_limit);
+    pthread_mutex_unlock(&mapcache_lock);
+
+    mapcache_release(victims);
+    return true;
+}
+
+// Returns the pages of free blocks that have been free for decay_ms, arena lock held.
+// Only bins that can hold stamped blocks are visited.
+static void decay_arena(Arena *arena, uint64_t now)
+{
+    for(size_t idx = next_nonempty_bin(arena, bin_index(STAMPED_SIZE)); idx < NUM_BINS; idx = next_nonempty_bin(arena, idx + 1))
+    {
+        Block *next;
+        for(Block *block = arena->bins[idx]; block; block = next)
+        {
+            next = free_links(block)->next_free;
+            uint64_t *stamp = free_stamp(block);
+            if(block_size(block) < STAMPED_SIZE || !*stamp || now - *stamp < decay_ms) continue;
+
+            HeapRegion *region = region_of(block + 1);
+            if(next_block(block) == region_fencepost(region))
+            {
+                if(block == region_first_block(region) && region != arena->top)
+                {
+                    region_release(arena, region);
+                    continue;
+                }
+                if(trim_threshold && block_size(block) >= trim_threshold && region_trim(arena, region, TRIM_PAD))
+                {
+                    *stamp = 0; // The pad stays warm for the next allocation
+                    continue;
+                }
+            }
+            purge_pages(block, (char*)block, (char*)next_block(block));
+            *stamp = 0;
+        }
+    }
+}
+
+static void *decay_thread(void *arg)
+{
+    (void)arg;
+    uint64_t step = decay_ms / DECAY_STEPS ? decay_ms / DECAY_STEPS : 1;
+    struct timespec pause = { (time_t)(step / 1000), (long)(step % 1000) * 1000000 };
+
+    for(;;)
+    {
+        nanosleep(&pause, NULL);
+        uint64_t now = now_ms();
+
+        for(unsigned i = 0; i < MAX_ARENAS; i++)
+        {
+            Arena *arena = &arenas[i];
+            if(!__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE)) continue;
+            pthread_mutex_lock(&arena->lock);
+            decay_arena(arena, now);
+            pthread_mutex_unlock(&arena->lock);
+        }
+
+        pthread_mutex_lock(&mapcache_lock);
+        CachedMapping *victims = mapcache_expire(now, mapcache_limit);
+        pthread_mutex_unlock(&mapcache_lock);
+        mapcache_release(victims);
+    }
+    return NULL;
+}
+
+static void decay_start(void)
+{
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, decay_thread, NULL) == 0) pthread_detach(thread);
+    else background = false; // Fall back to returning memory on free
+}
+
+// fork() copies only the calling thread, so every allocator lock is taken around it.
+// Otherwise a lock held by another thread at that moment stays held in the child.
+// Order: arenas_lock, the arenas by index, the mapping cache, the page map, the stats list,
+// the heap profile, the trace.
+static void atfork_prepare(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+    for(unsigned i = 0; i < MAX_ARENAS; i++)
+    {
+        if(arenas[i].initialized) pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&mapcache_lock);
+    pthread_mutex_lock(&pagemap_lock);
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void atfork_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&pagemap_lock);
+    pthread_mutex_unlock(&mapcache_lock);
+    for(unsigned i = MAX_ARENAS; i-- > 0;)
+    {
+        if(arenas[i].initialized) pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+static void atfork_child(void)
+{
+    //The child's events would land in the parent's trace, with addresses of its own
+    if(trace_fd >= 0)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        hooks &= ~HOOK_TRACE;
+    }
+    for(TraceBuffer *buf = trace_threads; buf; buf = buf->next)
+    {
+        pthread_mutex_init(&buf->lock, NULL);
+        buf->tail = buf->head;
+    }
+    pthread_mutex_init(&trace_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+    pthread_mutex_init(&stats_lock, NULL);
+    pthread_mutex_init(&pagemap_lock, NULL);
+    pthread_mutex_init(&mapcache_lock, NULL);
+    for(unsigned i = 0; i < MAX_ARENAS; i++)
+    {
+        if(arenas[i].initialized) pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    pthread_mutex_init(&arenas_lock, NULL);
+
+    //The decay thread did not survive the fork
+    if(background) decay_start();
+}
+
+static void atfork_register(void)
+{
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+// Raises the mmap threshold past size if a mapping of the same page count was
+// released moments ago. The thread that wins the race sets it, it never drops.
+static void mmap_threshold_adapt(size_t size, size_t pages)
+{
+    uint64_t seen = __atomic_load_n(&mmap_churn[pages % MMAP_CHURN_SLOTS], __ATOMIC_RELAXED);
+    if(seen >> 32 != pages || (uint32_t)(now_ms() - seen) >= MMAP_CHURN_WINDOW_MS) return;
+
+    size_t raised = size + ALIGNMENT;
+    if(raised > mmap_threshold_max) return;
+    size_t current = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+    while(raised > current && !__atomic_compare_exchange_n(&mmap_threshold, &current, raised, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void mmap_churn_note(size_t pages)
+{
+    uint64_t entry = (uint64_t)pages << 32 | (uint32_t)now_ms();
+    __atomic_store_n(&mmap_churn[pages % MMAP_CHURN_SLOTS], entry, __ATOMIC_RELAXED);
+}
+
+// A large block's header sits in the first page of its mapping, at the start unless
+// the block was mapped for an alignment above ALIGNMENT
+static char *large_base(Block *block)
+{
+    return (char*)((uintptr_t)block & ~(uintptr_t)((1UL << PAGEMAP_SHIFT) - 1));
+}
+
+static size_t large_len(Block *block)
+{
+    return (char*)block - large_base(block) + sizeof(Block) + block_size(block);
+}
+
+// Bytes of a small-page mapping of len bytes that are advised for transparent huge pages
+static size_t thp_len(size_t len)
+{
+    return hugepages && len >= HUGE_PAGE_SIZE ? len : 0;
+}
+
+// Maps a block of its own for a large request. It stays outside every arena, is
+// registered in the page map so my_free can find it, and goes back to the mapping
+// cache or the kernel when freed.
+static void *large_alloc(size_t size, bool sampled)
+{
+    pthread_once(&options_once, init_options);
+
+    size_t len = sizeof(Block) + size;
+    size_t pages = map_pages(len);
+    if(!sampled) mmap_threshold_adapt(size, pages); // Sampled objects of any size would look like churn
+
+    uintptr_t tag = sampled ? PAGEMAP_LARGE | PAGEMAP_SAMPLED : PAGEMAP_LARGE;
+    size_t fresh = BLOCK_ZERO; // Cached mappings have been used before
+    Block *block = mapcache_take(pages);
+    if (block) fresh = 0;
+#ifdef MAP_HUGETLB
+    if (!block && hugepages == 2 && len >= HUGE_PAGE_SIZE && !__atomic_load_n(&hugetlb_unavailable, __ATOMIC_RELAXED))
+    {
+        //Explicit huge pages come in whole pages, the rounding goes to the payload
+        size_t huge_len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        block = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block == MAP_FAILED)
+        {
+            __atomic_store_n(&hugetlb_unavailable, true, __ATOMIC_RELAXED);
+            block = NULL;
+        }
+        else
+        {
+            len = huge_len;
+            size = len - sizeof(Block);
+            tag |= PAGEMAP_HUGETLB;
+        }
+    }
+#endif
+    if (!block)
+    {
+        block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) return NULL;
+        if (thp_len(len)) advise_huge(block, len);
+    }
+    if (!pagemap_set(block, (uintptr_t)block | tag))
+    {
+        munmap(block, len);
+        return NULL;
+    }
+
+    block->size = size | BLOCK_MMAP | fresh;
+    block->magic = ALLOC_MAGIC;
+    block->arena = 0;
+    __atomic_add_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_bytes, len, __ATOMIC_RELAXED);
+    if (tag & PAGEMAP_HUGETLB) __atomic_add_fetch(&huge_explicit_bytes, len, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&huge_advised_bytes, thp_len(len), __ATOMIC_RELAXED);
+    if (size <= TCACHE_MAX_SIZE && !__atomic_load_n(&small_mapped, __ATOMIC_RELAXED)) __atomic_store_n(&small_mapped, true, __ATOMIC_RELAXED);
+    stats_alloc(size, true);
+    return (void*)((char*)block + sizeof(Block));
+}
+
+static void large_free(Block *block)
+{
+    char *base = large_base(block);
+    size_t len = large_len(block);
+
+    uintptr_t entry = pagemap_get(block);
+    if (entry & PAGEMAP_SAMPLED) profile_forget(block);
+    stats_free(block_size(block), true);
+    block->magic = FREED_MAGIC;
+    if (entry & PAGEMAP_HUGETLB) __atomic_sub_fetch(&huge_explicit_bytes, len, __ATOMIC_RELAXED);
+    else __atomic_sub_fetch(&huge_advised_bytes, thp_len(len), __ATOMIC_RELAXED);
+    pagemap_set(block, 0);
+    __atomic_sub_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mmap_bytes, len, __ATOMIC_RELAXED);
+    if (!(entry & PAGEMAP_SAMPLED)) mmap_churn_note(map_pages(len));
+    if ((char*)block != base || !mapcache_put(block, map_pages(len))) munmap(base, len);
+}
+
+// Resizes a mapped block by remapping its pages instead of copying them. Shrinking
+// releases the tail pages in place. Returns NULL if the kernel refused.
+static void *large_realloc(Block *block, size_t size)
+{
+#ifdef MREMAP_MAYMOVE
+    char *base = large_base(block);
+    size_t offset = (char*)block - base;
+    size_t old_len = large_len(block);
+    size_t new_len = offset + sizeof(Block) + size;
+    uintptr_t entry = pagemap_get(block);
+    if (entry & PAGEMAP_HUGETLB) return NULL; // Explicit huge pages only move whole
+
+    //Once mremap moves the block its old range can be mapped again by another thread,
+    //which must not find this entry there or have its own cleared by us afterwards
+    pagemap_set(block, 0);
+    char *moved_base = mremap(base, old_len, new_len, MREMAP_MAYMOVE);
+    Block *moved = moved_base == MAP_FAILED ? block : (Block*)(moved_base + offset);
+    pagemap_set(moved, moved == block ? entry : (uintptr_t)moved | PAGEMAP_LARGE);
+    if (moved_base == MAP_FAILED) return NULL;
+
+    if (thp_len(new_len)) advise_huge(moved_base, new_len);
+
+    stats_resize(old_len - offset - sizeof(Block), size);
+    moved->size = size | BLOCK_MMAP;
+    __atomic_add_fetch(&mmap_bytes, new_len - old_len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&huge_advised_bytes, thp_len(new_len) - thp_len(old_len), __ATOMIC_RELAXED);
+    return (void*)((char*)moved + sizeof(Block));
+#else
+    (void)block;
+    (void)size;
+    return NULL;
+#endif
+}
+
+// Opt-in latency histograms, enabled with MALLOCATOR_LATENCY=1 or my_latency_enable().
+// Every call is timed with the cycle counter and counted in a per-thread histogram
+// for the path it took. Buckets are logarithmic with four steps per power of two.
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+enum {
+    LAT_MALLOC_CACHE,  // Thread cache hit
+    LAT_MALLOC_SLAB,
+    LAT_MALLOC_BIN,    // Free block used whole
+    LAT_MALLOC_SPLIT,  // Free block split
+    LAT_MALLOC_GROW,   // Heap grown or a new segment started
+    LAT_MALLOC_MMAP,   // Own mapping, from the mapping cache or the kernel
+    LAT_FREE_CACHE,
+    LAT_FREE_SLAB,
+    LAT_FREE_HEAP,     // Coalescing, and trimming or purging if that applies
+    LAT_FREE_MMAP,
+    LAT_REALLOC_IN_PLACE,
+    LAT_REALLOC_REMAP,
+    LAT_REALLOC_MOVE,
+    LAT_PATHS
+};
+
+static const char *const latency_names[LAT_PATHS] = {
+    "malloc thread cache", "malloc slab", "malloc free list", "malloc split", "malloc grow heap", "malloc mmap",
+    "free thread cache", "free slab", "free heap", "free mmap",
+    "realloc in place", "realloc remap", "realloc move",
+};
+
+typedef struct LatencyHist {
+    uint64_t counts[LAT_PATHS][LAT_BUCKETS];
+    uint64_t max[LAT_PATHS];
+    struct LatencyHist *next;
+    struct LatencyHist *prev;
+} LatencyHist;
+
+static LatencyHist *latency_threads;  // On stats_lock, like the counters
+static LatencyHist latency_retired;
+static uint64_t latency_calib_cycles; // Cycle counter and clock when timing was switched on
+static uint64_t latency_calib_ns;
+static pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t value)
+{
+    if(value < (1 << LAT_SUB_BITS)) return value;
+    size_t log = 63 - __builtin_clzl(value);
+    return ((log - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + ((value >> (log - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// Smallest value that falls into a bucket
+static uint64_t latency_bucket_floor(size_t bucket)
+{
+    if(bucket < (1 << LAT_SUB_BITS)) return bucket;
+    size_t log = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << LAT_SUB_BITS) - 1);
+    return ((1ULL << LAT_SUB_BITS) + sub) << (log - LAT_SUB_BITS);
+}
+
+static void latency_start(void)
+{
+    latency_calib_ns = clock_ns();
+    latency_calib_cycles = cycles();
+}
+
+void my_latency_enable(int on)
+{
+    pthread_once(&options_once, init_options);
+    pthread_once(&latency_once, latency_start);
+    if(on) __atomic_or_fetch(&hooks, HOOK_LATENCY, __ATOMIC_RELAXED);
+    else __atomic_and_fetch(&hooks, ~HOOK_LATENCY, __ATOMIC_RELAXED);
+}
+
+// Histograms of the calling thread, mapped on its first timed call. Threads past their
+// exit destructor, or when the mapping fails, count into the retired set.
+static LatencyHist *thread_latency(void)
+{
+    if(tcache.shutdown) return &latency_retired;
+    if(tcache.latency) return tcache.latency;
+    if(!tcache.registered) tcache_register();
+    pthread_once(&latency_once, latency_start);
+
+    LatencyHist *hist = mmap(NULL, sizeof(LatencyHist), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(hist == MAP_FAILED) return &latency_retired;
+
+    pthread_mutex_lock(&stats_lock);
+    hist->next = latency_threads;
+    if(latency_threads) latency_threads->prev = hist;
+    latency_threads = hist;
+    pthread_mutex_unlock(&stats_lock);
+    tcache.latency = hist;
+    return hist;
+}
+
+static void latency_record(unsigned path, uint64_t elapsed)
+{
+    if(path >= LAT_PATHS) return;
+
+    LatencyHist *hist = thread_latency();
+    uint64_t *count = &hist->counts[path][latency_bucket(elapsed)];
+    if(hist == &latency_retired)
+    {
+        __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&hist->max[path], __ATOMIC_RELAXED);
+        while(elapsed > max && !__atomic_compare_exchange_n(&hist->max[path], &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return;
+    }
+
+    //Only this thread writes its histograms
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    if(elapsed > hist->max[path]) __atomic_store_n(&hist->max[path], elapsed, __ATOMIC_RELAXED);
+}
+
+// Folds an exiting thread's histograms into the retired set and unmaps them
+static void latency_retire(LatencyHist *hist)
+{
+    pthread_mutex_lock(&stats_lock);
+    for(size_t path = 0; path < LAT_PATHS; path++)
+    {
+        for(size_t b = 0; b < LAT_BUCKETS; b++) __atomic_add_fetch(&latency_retired.counts[path][b], hist->counts[path][b], __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&latency_retired.max[path], __ATOMIC_RELAXED);
+        while(hist->max[path] > max && !__atomic_compare_exchange_n(&latency_retired.max[path], &max, hist->max[path], true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    if(hist->prev) hist->prev->next = hist->next;
+    else latency_threads = hist->next;
+    if(hist->next) hist->next->prev = hist->prev;
+    pthread_mutex_unlock(&stats_lock);
+    munmap(hist, sizeof(LatencyHist));
+}
+
+size_t my_latency_report(MyLatency *report, size_t n)
+{
+    static uint64_t counts[LAT_BUCKETS]; // Summed under stats_lock
+    size_t filled = 0;
+
+    //Cycles per nanosecond, measured over the time since timing was switched on
+    uint64_t ns = latency_calib_ns ? clock_ns() - latency_calib_ns : 0;
+    double per_ns = ns ? (double)(cycles() - latency_calib_cycles) / (double)ns : 1.0;
+    if(per_ns <= 0) per_ns = 1.0;
+
+    pthread_mutex_lock(&stats_lock);
+    for(size_t path = 0; path < LAT_PATHS && filled < n; path++)
+    {
+        uint64_t total = 0, max = __atomic_load_n(&latency_retired.max[path], __ATOMIC_RELAXED);
+        for(size_t b = 0; b < LAT_BUCKETS; b++)
+        {
+            counts[b] = __atomic_load_n(&latency_retired.counts[path][b], __ATOMIC_RELAXED);
+            for(LatencyHist *hist = latency_threads; hist; hist = hist->next) counts[b] += __atomic_load_n(&hist->counts[path][b], __ATOMIC_RELAXED);
+            total += counts[b];
+        }
+        for(LatencyHist *hist = latency_threads; hist; hist = hist->next)
+        {
+            uint64_t thread_max = __atomic_load_n(&hist->max[path], __ATOMIC_RELAXED);
+            if(thread_max > max) max = thread_max;
+        }
+        if(!total) continue;
+
+        static const double quantiles[4] = { 0.50, 0.90, 0.99, 0.999 };
+        double values[4];
+        uint64_t seen = 0;
+        size_t q = 0;
+        for(size_t b = 0; b < LAT_BUCKETS && q < 4; b++)
+        {
+            seen += counts[b];
+            while(q < 4 && seen >= (uint64_t)(quantiles[q] * (double)total + 0.5) && seen) values[q++] = (double)latency_bucket_floor(b) / per_ns;
+        }
+        while(q < 4) values[q++] = (double)max / per_ns;
+
+        MyLatency *out = &report[filled++];
+        out->path = latency_names[path];
+        out->count = total;
+        out->p50_ns = values[0];
+        out->p90_ns = values[1];
+        out->p99_ns = values[2];
+        out->p999_ns = values[3];
+        out->max_ns = (double)max / per_ns;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return filled;
+}
+
+void print_latency_stats(void)
+{
+    MyLatency report[LAT_PATHS];
+    size_t n = my_latency_report(report, LAT_PATHS);
+
+    printf("Latency (ns, lower bucket bounds)     count       p50       p90       p99     p99.9       max\n");
+    for(size_t i = 0; i < n; i++)
+    {
+        printf("%-30s %12zu %9.0f %9.0f %9.0f %9.0f %9.0f\n", report[i].path, report[i].count,
+               report[i].p50_ns, report[i].p90_ns, report[i].p99_ns, report[i].p999_ns, report[i].max_ns);
+    }
+}
+
+static void *malloc_path(size_t size, unsigned *path)
+{
+    Block *block;
+    *path = LAT_PATHS; // Failures are not timed
+    if(size <= 0 || size > SIZE_MAX - sizeof(Block) - sizeof(Footer)) 
+    {
+        //fprintf(stderr,"Overflow or underflow in my_malloc with size %zu\n", size);
+        return NULL; //Invalid size
+    }
+    size_t  actual_size = size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : ALIGN(size);
+    //size_t  total_size = sizeof(Block) + actual_size + sizeof(Footer);
+
+    if(actual_size <= TCACHE_MAX_SIZE)
+    {
+        void *cached = tcache_pop(&tcache, actual_size / ALIGNMENT);
+        if(cached)
+        {
+            *path = LAT_MALLOC_CACHE;
+            stats_cached(tcache.stats.allocs, actual_size, &tcache.stats.allocated_bytes);
+            return cached;
+        }
+    }
+
+    if(IS_MMAP(actual_size))
+    {
+        *path = LAT_MALLOC_MMAP;
+        return large_alloc(actual_size, false);
+    }
+
+    Arena *arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+
+    if(actual_size <= slab_cutoff)
+    {
+        size_t cls = slab_class(actual_size);
+        void *ptr = slab_alloc(arena, cls);
+        if(ptr) tcache_refill_slab_locked(arena, cls);
+        pthread_mutex_unlock(&arena->lock);
+        if(ptr) stats_alloc(cls * ALIGNMENT, false);
+        *path = LAT_MALLOC_SLAB;
+        return ptr;
+    }
+
+    //A heap block must be able to hold its bin links and footer once it is freed
+    if(actual_size < MIN_PAYLOAD) actual_size = ALIGN(MIN_PAYLOAD);
+
+    if(validate_level >= 3) validate_heap(arena); // Validate the heap before allocation
+
+    block = find_best_fit(arena, actual_size);
+    if(block) *path = block_size(block) >= actual_size + MIN_BLOCK_SIZE ? LAT_MALLOC_SPLIT : LAT_MALLOC_BIN;
+    else
+    {
+        block = request_space(arena, actual_size);
+        *path = LAT_MALLOC_GROW;
+    }
+    if(!block || (validate_level && !check_block(block, true)))  
+    {
+        pthread_mutex_unlock(&arena->lock);
+        *path = LAT_PATHS;
+        return NULL;
+    }
+    take_block(arena, block, actual_size);
+    if(actual_size <= TCACHE_MAX_SIZE && !best_fit) tcache_refill_locked(arena, actual_size / ALIGNMENT);
+    actual_size = block_size(block); // Includes a tail too small to split off
+    maybe_validate_heap(arena);
+    pthread_mutex_unlock(&arena->lock);
+    stats_alloc(actual_size, false);
+    return (void*)((char*)block + sizeof(Block)); //Return a pointer to the memory after the block header
+
+}
+
+// Sampling heap profiler. Each thread counts down a random number of bytes drawn from
+// an exponential distribution with mean profile_rate, and the allocation that crosses
+// zero is sampled: its call stack is recorded and it gets a mapping of its own, tagged
+// in the page map, so free finds the sample without a lookup table. Every byte is
+// equally likely to be sampled, which is what pprof assumes when it scales heap_v2
+// profiles back up.
+#define PROFILE_DEPTH 32      // Frames kept per stack
+#define PROFILE_SKIP 2        // profile_alloc and malloc_hooked, stacks start at my_malloc
+#define PROFILE_STACKS 8192   // Distinct stacks, a power of two
+#define PROFILE_SAMPLES 65536 // Sampled objects alive at once
+#define PROFILE_UNTRACKED UINT32_MAX
+
+typedef struct ProfileStack {
+    uint64_t hash;
+    size_t depth;
+    void *frames[PROFILE_DEPTH];
+    size_t alloc_count; // Samples taken here, freed or not
+    size_t alloc_bytes;
+    size_t live_count;  // Samples still allocated
+    size_t live_bytes;
+} ProfileStack;
+
+typedef struct ProfileSample {
+    uint32_t stack;
+    uint32_t next_free;
+    size_t size; // Requested size
+} ProfileSample;
+
+static ProfileStack *profile_stacks; // Both tables on profile_lock, mapped on first use
+static ProfileSample *profile_samples;
+static uint32_t profile_samples_used;
+static uint32_t profile_free_sample = PROFILE_UNTRACKED;
+static size_t profile_dropped; // Samples that found the tables full
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+
+static void profile_start(void)
+{
+    //The first backtrace() loads the unwinder, which allocates, so get that over with here
+    void *frame;
+    backtrace(&frame, 1);
+
+    void *stacks = mmap(NULL, PROFILE_STACKS * sizeof(ProfileStack), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *samples = mmap(NULL, PROFILE_SAMPLES * sizeof(ProfileSample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(stacks == MAP_FAILED || samples == MAP_FAILED)
+    {
+        if(stacks != MAP_FAILED) munmap(stacks, PROFILE_STACKS * sizeof(ProfileStack));
+        if(samples != MAP_FAILED) munmap(samples, PROFILE_SAMPLES * sizeof(ProfileSample));
+        return; // Sampled objects are then counted as dropped
+    }
+    profile_stacks = stacks;
+    profile_samples = samples;
+}
+
+static uint64_t profile_next_rand(void)
+{
+    uint64_t x = tcache.sample_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return tcache.sample_rng = x;
+}
+
+// Bytes until the next sample, -ln(u) * rate for u uniform in (0, 1]. The logarithm
+// comes from the double's exponent plus a quadratic fit of log2 over the mantissa,
+// which is within 0.5% and keeps libm out of the allocator.
+static size_t profile_gap(size_t rate)
+{
+    double u = (double)((profile_next_rand() >> 11) + 1) / (double)(1ULL << 53);
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    double exponent = (double)(int)((bits >> 52) & 0x7ff) - 1023.0;
+    double f = (double)(bits & ((1ULL << 52) - 1)) / (double)(1ULL << 52);
+    double log2u = exponent + f + 0.346607 * f * (1.0 - f);
+
+    double gap = -log2u * 0.6931471805599453 * (double)rate;
+    if(gap < 1.0) return 1;
+    if(gap >= (double)(SIZE_MAX / 2)) return SIZE_MAX / 2;
+    return (size_t)gap;
+}
+
+// Counts size down from the thread's byte budget, true if this allocation is sampled
+static bool profile_due(size_t size)
+{
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if(!rate) return false;
+
+    if(!tcache.sample_rng)
+    {
+        uint64_t seed = clock_ns() ^ (uintptr_t)&tcache;
+        seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+        tcache.sample_rng = (seed ^ (seed >> 31)) | 1;
+        tcache.sample_countdown = profile_gap(rate);
+    }
+    if(size < tcache.sample_countdown)
+    {
+        tcache.sample_countdown -= size;
+        return false;
+    }
+    tcache.sample_countdown = profile_gap(rate);
+    return true;
+}
+
+// Finds or adds the stack and claims a sample slot for the block, returns the slot
+static uint32_t profile_track(void **frames, size_t depth, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for(size_t i = 0; i < depth; i++) hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001B3ULL;
+
+    uint32_t slot = PROFILE_UNTRACKED;
+    pthread_mutex_lock(&profile_lock);
+    if(!profile_stacks)
+    {
+        profile_dropped++;
+        pthread_mutex_unlock(&profile_lock);
+        return slot;
+    }
+
+    ProfileStack *stack = NULL;
+    for(size_t probe = 0; probe < PROFILE_STACKS; probe++)
+    {
+        ProfileStack *candidate = &profile_stacks[(hash + probe) & (PROFILE_STACKS - 1)];
+        if(!candidate->alloc_count)
+        {
+            candidate->hash = hash;
+            candidate->depth = depth;
+            memcpy(candidate->frames, frames, depth * sizeof(void*));
+            stack = candidate;
+            break;
+        }
+        if(candidate->hash == hash && candidate->depth == depth && !memcmp(candidate->frames, frames, depth * sizeof(void*)))
+        {
+            stack = candidate;
+            break;
+        }
+    }
+
+    if(stack && profile_free_sample != PROFILE_UNTRACKED)
+    {
+        slot = profile_free_sample;
+        profile_free_sample = profile_samples[slot].next_free;
+    }
+    else if(stack && profile_samples_used < PROFILE_SAMPLES) slot = profile_samples_used++;
+
+    if(slot == PROFILE_UNTRACKED) profile_dropped++;
+    else
+    {
+        profile_samples[slot].stack = (uint32_t)(stack - profile_stacks);
+        profile_samples[slot].size = size;
+        stack->alloc_count++;
+        stack->alloc_bytes += size;
+        stack->live_count++;
+        stack->live_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return slot;
+}
+
+// Sampled blocks keep their slot where heap blocks keep their arena index
+static void profile_forget(Block *block)
+{
+    uint32_t slot = block->arena;
+    if(slot == PROFILE_UNTRACKED) return;
+
+    pthread_mutex_lock(&profile_lock);
+    ProfileSample *sample = &profile_samples[slot];
+    ProfileStack *stack = &profile_stacks[sample->stack];
+    stack->live_count--;
+    stack->live_bytes -= sample->size;
+    sample->next_free = profile_free_sample;
+    profile_free_sample = slot;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Out of line so the number of frames to skip is the same at every optimisation level
+__attribute__((noinline)) static void *profile_alloc(size_t size, unsigned *path)
+{
+    pthread_once(&profile_once, profile_start);
+
+    //Unwinding takes no allocator lock, so it happens before any is held
+    void *frames[PROFILE_DEPTH + PROFILE_SKIP];
+    int depth = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP);
+    depth = depth > PROFILE_SKIP ? depth - PROFILE_SKIP : 0;
+
+    void *ptr = large_alloc(size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : ALIGN(size), true);
+    if(!ptr) return malloc_path(size, path);
+    get_block_ptr(ptr)->arena = profile_track(frames + PROFILE_SKIP, (size_t)depth, size);
+    *path = LAT_MALLOC_MMAP;
+    return ptr;
+}
+
+void my_profile_set_rate(size_t bytes)
+{
+    pthread_once(&options_once, init_options);
+    __atomic_store_n(&profile_rate, bytes, __ATOMIC_RELAXED);
+    tcache.sample_rng = 0; // Redraws this thread's countdown, others pick the rate up at their next sample
+    if(bytes) __atomic_or_fetch(&hooks, HOOK_PROFILE, __ATOMIC_RELAXED);
+    else __atomic_and_fetch(&hooks, ~HOOK_PROFILE, __ATOMIC_RELAXED);
+}
+
+// Buffered writes to a file descriptor, stdio would allocate
+typedef struct ProfileWriter {
+    int fd;
+    bool failed;
+    size_t used;
+    char buf[4096];
+} ProfileWriter;
+
+static void profile_flush(ProfileWriter *out)
+{
+    size_t done = 0;
+    while(done < out->used && !out->failed)
+    {
+        ssize_t n = write(out->fd, out->buf + done, out->used - done);
+        if(n > 0) done += (size_t)n;
+        else if(n < 0 && errno != EINTR) out->failed = true;
+    }
+    out->used = 0;
+}
+
+__attribute__((format(printf, 2, 3))) static void profile_printf(ProfileWriter *out, const char *fmt, ...)
+{
+    if(out->used > sizeof(out->buf) - 256) profile_flush(out);
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->used, sizeof(out->buf) - out->used, fmt, args);
+    va_end(args);
+    if(n > 0) out->used += (size_t)n < sizeof(out->buf) - out->used ? (size_t)n : sizeof(out->buf) - out->used - 1;
+}
+
+int my_profile_dump(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return -1;
+
+    static ProfileWriter out; // Only used on profile_lock
+    pthread_mutex_lock(&profile_lock);
+    out.fd = fd;
+    out.failed = false;
+    out.used = 0;
+
+    //Raw sample counts, pprof scales them by the rate in the header
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for(size_t i = 0; profile_stacks && i < PROFILE_STACKS; i++)
+    {
+        live_count += profile_stacks[i].live_count;
+        live_bytes += profile_stacks[i].live_bytes;
+        alloc_count += profile_stacks[i].alloc_count;
+        alloc_bytes += profile_stacks[i].alloc_bytes;
+    }
+    profile_printf(&out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", live_count, live_bytes, alloc_count, alloc_bytes,
+                   __atomic_load_n(&profile_rate, __ATOMIC_RELAXED));
+    for(size_t i = 0; profile_stacks && i < PROFILE_STACKS; i++)
+    {
+        ProfileStack *stack = &profile_stacks[i];
+        if(!stack->alloc_count) continue;
+        profile_printf(&out, "%6zu: %8zu [%6zu: %8zu] @", stack->live_count, stack->live_bytes, stack->alloc_count, stack->alloc_bytes);
+        for(size_t f = 0; f < stack->depth; f++) profile_printf(&out, " %p", stack->frames[f]);
+        profile_printf(&out, "\n");
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    //pprof resolves the addresses with the mappings at the end of the file
+    profile_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    profile_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if(maps >= 0)
+    {
+        ssize_t n;
+        while((n = read(maps, out.buf, sizeof(out.buf))) > 0 || (n < 0 && errno == EINTR))
+        {
+            if(n < 0) continue;
+            out.used = (size_t)n;
+            profile_flush(&out);
+        }
+        close(maps);
+    }
+
+    bool failed = out.failed;
+    if(close(fd) < 0) failed = true;
+    return failed ? -1 : 0;
+}
+
+// Allocation tracing. Each thread appends events to a ring of its own without locks
+// or atomic read-modify-writes: only the owner moves head, and tail only moves while
+// the ring's flush lock is held, by the owner when the ring is full or by
+// my_trace_stop and thread exit for what is left. Flushes are single write()s to a
+// file opened with O_APPEND, so threads' chunks interleave whole, and the replay
+// tool orders the events by time. Allocations are stamped after they return and
+// frees before they start, so a reused address never appears to be handed out again
+// before it was freed.
+static void trace_write(int fd, const void *data, size_t len)
+{
+    const char *from = data;
+    while(len)
+    {
+        ssize_t n = write(fd, from, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return; // A full disk loses events rather than stalling the program
+        from += n;
+        len -= (size_t)n;
+    }
+}
+
+// Writes out [tail, head) to fd, or drops it if fd is -1. Buffer lock held.
+static void trace_drain(TraceBuffer *buf, int fd)
+{
+    size_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+    size_t tail = buf->tail;
+
+    while(fd >= 0 && tail != head)
+    {
+        //The ring wraps at most once between tail and head
+        size_t start = tail & (TRACE_EVENTS - 1);
+        size_t count = head - tail < TRACE_EVENTS - start ? head - tail : TRACE_EVENTS - start;
+        trace_write(fd, &buf->events[start], count * sizeof(MyTraceEvent));
+        tail += count;
+    }
+    __atomic_store_n(&buf->tail, head, __ATOMIC_RELEASE);
+}
+
+// Ring of the calling thread, mapped on its first traced call. NULL past the exit
+// destructor or when the mapping fails.
+static TraceBuffer *thread_trace(void)
+{
+    if(tcache.shutdown) return NULL;
+    if(tcache.trace) return tcache.trace;
+    if(!tcache.registered) tcache_register();
+
+    TraceBuffer *buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED) return NULL;
+    pthread_mutex_init(&buf->lock, NULL);
+    buf->thread = __atomic_add_fetch(&trace_thread_ids, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&trace_lock);
+    buf->next = trace_threads;
+    if(trace_threads) trace_threads->prev = buf;
+    trace_threads = buf;
+    pthread_mutex_unlock(&trace_lock);
+    tcache.trace = buf;
+    return buf;
+}
+
+static void trace_record(uint32_t op, const void *ptr, size_t size, uintptr_t arg)
+{
+    MyTraceEvent event = { clock_ns() - trace_epoch, size, (uintptr_t)ptr, arg, 0, op };
+    TraceBuffer *buf = thread_trace();
+    if(!buf)
+    {
+        //Threads without a ring write their few events directly
+        pthread_mutex_lock(&trace_lock);
+        if(trace_fd >= 0) trace_write(trace_fd, &event, sizeof(event));
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    event.thread = buf->thread;
+    size_t head = buf->head;
+    if(head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) == TRACE_EVENTS)
+    {
+        pthread_mutex_lock(&buf->lock);
+        trace_drain(buf, __atomic_load_n(&trace_fd, __ATOMIC_RELAXED));
+        pthread_mutex_unlock(&buf->lock);
+    }
+    buf->events[head & (TRACE_EVENTS - 1)] = event;
+    __atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Marks the calling thread as inside a traced call, so the my_malloc and my_free
+// calls that realloc and friends make internally are not recorded a second time.
+// False if tracing is off or this call is itself nested.
+static bool trace_enter(void)
+{
+    if(!(__atomic_load_n(&hooks, __ATOMIC_RELAXED) & HOOK_TRACE) || tcache.trace_nested) return false;
+    tcache.trace_nested = true;
+    return true;
+}
+
+static void trace_leave(uint32_t op, const void *ptr, size_t size, uintptr_t arg)
+{
+    trace_record(op, ptr, size, arg);
+    tcache.trace_nested = false;
+}
+
+// Flushes an exiting thread's ring and unmaps it
+static void trace_retire(TraceBuffer *buf)
+{
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&buf->lock);
+    trace_drain(buf, trace_fd);
+    pthread_mutex_unlock(&buf->lock);
+    if(buf->prev) buf->prev->next = buf->next;
+    else trace_threads = buf->next;
+    if(buf->next) buf->next->prev = buf->prev;
+    pthread_mutex_unlock(&trace_lock);
+    munmap(buf, sizeof(TraceBuffer));
+}
+
+// Called from init_options for MALLOCATOR_TRACE as well, so it must not wait on it
+static int trace_open(const char *path)
+{
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd >= 0)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    MyTraceHeader header = { MY_TRACE_MAGIC, MY_TRACE_VERSION, sizeof(MyTraceEvent) };
+    trace_write(fd, &header, sizeof(header));
+    for(TraceBuffer *buf = trace_threads; buf; buf = buf->next)
+    {
+        //Leftovers of an earlier trace
+        pthread_mutex_lock(&buf->lock);
+        trace_drain(buf, -1);
+        pthread_mutex_unlock(&buf->lock);
     }
-    
+    trace_epoch = clock_ns();
+    __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&hooks, HOOK_TRACE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int my_trace_start(const char *path)
+{
+    pthread_once(&options_once, init_options);
+    return trace_open(path);
+}
+
+int my_trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    int fd = trace_fd;
+    if(fd < 0)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    //Rings drained from here on drop their events, a call racing with the stop may lose its own
+    __atomic_and_fetch(&hooks, ~HOOK_TRACE, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    for(TraceBuffer *buf = trace_threads; buf; buf = buf->next)
+    {
+        pthread_mutex_lock(&buf->lock);
+        trace_drain(buf, fd);
+        pthread_mutex_unlock(&buf->lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return close(fd);
+}
+
+// The main thread has no exit destructor, so whatever is still in the rings at exit
+// is written out here. Calls from later destructors go unrecorded.
+__attribute__((destructor)) static void trace_at_exit(void)
+{
+    if(__atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0) my_trace_stop();
+}
+
+__attribute__((noinline)) static void *malloc_hooked(size_t size, unsigned active)
+{
+    unsigned path;
+    uint64_t start = active & HOOK_LATENCY ? cycles() : 0;
+
+    void *ptr;
+    if((active & HOOK_PROFILE) && size && size <= SIZE_MAX - sizeof(Block) - sizeof(Footer) && profile_due(size)) ptr = profile_alloc(size, &path);
+    else ptr = malloc_path(size, &path);
+
+    if(active & HOOK_LATENCY) latency_record(path, cycles() - start);
+    if((active & HOOK_TRACE) && !tcache.trace_nested) trace_record(MY_TRACE_MALLOC, ptr, size, 0);
+    return ptr;
+}
+
+void* my_malloc(size_t size)
+{
+    unsigned path;
+    unsigned active = __atomic_load_n(&hooks, __ATOMIC_RELAXED);
+    if(!active) return malloc_path(size, &path);
+    return malloc_hooked(size, active);
+}
+
+// Maps a large block whose payload is aligned to more than ALIGNMENT. The pages in
+// front of the header's page and past the payload go straight back.
+static void *large_aligned_alloc(size_t alignment, size_t size)
+{
+    pthread_once(&options_once, init_options);
+
+    size_t page = 1UL << PAGEMAP_SHIFT;
+    size_t span = map_pages(sizeof(Block) + size + alignment) * page;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char *payload = (char*)(((uintptr_t)raw + sizeof(Block) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    Block *block = (Block*)(payload - sizeof(Block));
+    char *base = large_base(block);
+    char *end = base + map_pages(payload + size - base) * page;
+    if (base > raw) munmap(raw, base - raw);
+    if (raw + span > end) munmap(end, raw + span - end);
+
+    block->size = size | BLOCK_MMAP | BLOCK_ZERO;
+    block->magic = ALLOC_MAGIC;
+    block->arena = 0;
+    size_t len = large_len(block);
+    if (thp_len(len)) advise_huge(base, len);
+    if (!pagemap_set(block, (uintptr_t)block | PAGEMAP_LARGE))
+    {
+        munmap(base, len);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&mmap_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmap_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&huge_advised_bytes, thp_len(len), __ATOMIC_RELAXED);
+    if (size <= TCACHE_MAX_SIZE && !__atomic_load_n(&small_mapped, __ATOMIC_RELAXED)) __atomic_store_n(&small_mapped, true, __ATOMIC_RELAXED);
+    stats_alloc(size, true);
+    return payload;
+}
+
+// Carves an aligned block out of the heap. The block is taken big enough to hold a
+// free block in front of an aligned payload, then the front and the tail past size
+// go back to the bins through coalesce_blocks and split.
+static void *heap_aligned_alloc(size_t alignment, size_t size)
+{
+    size_t request = size + alignment + MIN_BLOCK_SIZE;
+    Arena *arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+
+    Block *block = find_best_fit(arena, request);
+    if(!block) block = request_space(arena, request);
+    if(!block || (validate_level && !check_block(block, true)))
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    take_block(arena, block, request);
+
+    uintptr_t payload = (uintptr_t)block + sizeof(Block);
+    if(payload & (alignment - 1))
+    {
+        Block *aligned = (Block*)(((payload + MIN_BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1)) - sizeof(Block));
+        size_t lead = (char*)aligned - (char*)block;
+
+        aligned->size = block_size(block) - lead;
+        aligned->magic = ALLOC_MAGIC;
+        aligned->arena = arena->index;
+
+        block->size = (lead - sizeof(Block)) | (block->size & BLOCK_PREV_FREE);
+        block->magic = FREED_MAGIC;
+        coalesce_blocks(arena, block);
+        block = aligned;
+    }
+    split(arena, block, size);
+    size = block_size(block);
+
+    maybe_validate_heap(arena);
+    pthread_mutex_unlock(&arena->lock);
+    stats_alloc(size, false);
+    return (char*)block + sizeof(Block);
+}
+
+static void *aligned_alloc_path(size_t alignment, size_t size)
+{
+    if(!alignment || (alignment & (alignment - 1))) return NULL;
+    if(alignment <= ALIGNMENT) return my_malloc(size);
+    if(!size || size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4) return NULL;
+
+    size_t actual_size = ALIGN(size) < ALIGN(MIN_PAYLOAD) ? ALIGN(MIN_PAYLOAD) : ALIGN(size);
+    //Once the slack alone would be a large request the whole thing gets its own mapping
+    if(IS_MMAP(actual_size + alignment)) return large_aligned_alloc(alignment, actual_size);
+    return heap_aligned_alloc(alignment, actual_size);
+}
+
+void *my_aligned_alloc(size_t alignment, size_t size)
+{
+    if(!trace_enter()) return aligned_alloc_path(alignment, size);
+
+    void *ptr = aligned_alloc_path(alignment, size);
+    trace_leave(MY_TRACE_ALIGNED, ptr, size, alignment);
+    return ptr;
+}
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*)) return EINVAL;
+    if(!size)
+    {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void *ptr = my_aligned_alloc(alignment, size);
+    if(!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *my_memalign(size_t alignment, size_t size)
+{
+    if(alignment > SIZE_MAX / 2) return NULL;
+
+    size_t pow2 = ALIGNMENT;
+    while(pow2 < alignment) pow2 <<= 1;
+    return my_aligned_alloc(pow2, size);
+}
+
+static void *calloc_path(size_t nmemb, size_t size)
+{
+    if (nmemb == 0 || size == 0) return NULL;
+
+    if (size > SIZE_MAX / nmemb) return NULL;
+
+    size_t total_size = nmemb * size;
+
+    if (total_size > SIZE_MAX - sizeof(Block) - sizeof(Footer)) return NULL;
+
+    void *ptr = my_malloc(total_size);
+    if (!ptr) return NULL;
+
+    //Above the thread cache limit a block comes straight from a bin or a mapping, so a
+    //zero flag is fresh and only the free-block metadata needs clearing. The untouched
+    //pages stay unfaulted until the caller writes to them.
+    if (total_size > TCACHE_MAX_SIZE && !slab_of(ptr))
+    {
+        Block *block = get_block_ptr(ptr);
+        if (block->size & BLOCK_ZERO)
+        {
+            block->size &= ~BLOCK_ZERO;
+            if (!(block->size & BLOCK_MMAP))
+            {
+                memset(ptr, 0, ZERO_HEAD < total_size ? ZERO_HEAD : total_size);
+                memset((char*)ptr + block_size(block) - sizeof(Footer), 0, sizeof(Footer));
+            }
+            return ptr;
+        }
+    }
+
+    memset(ptr, 0, total_size);
+    return ptr;
+}
+
+void *my_calloc(size_t nmemb, size_t size)
+{
+    if(!trace_enter()) return calloc_path(nmemb, size);
+
+    void *ptr = calloc_path(nmemb, size);
+    trace_leave(MY_TRACE_CALLOC, ptr, size, nmemb);
+    return ptr;
+}
+
+Block *get_block_ptr(void *ptr) 
+{
+  if(!ptr) return NULL;
+    Block* block = (Block*)((char*)ptr - sizeof(Block));
+    //if(block->magic != ALLOC_MAGIC && block->magic != FREED_MAGIC) return NULL;
+    return block;
+}
+
+// Returns a used heap block to its arena, arena lock held
+static void release_block(Arena *arena, Block *block_ptr)
+{
+    char *from = (char*)block_ptr, *to = (char*)next_block(block_ptr);
+
+    block_ptr->magic = FREED_MAGIC;
+    block_ptr->size &= ~BLOCK_ZERO;
+    release_free_memory(arena, coalesce_blocks(arena, block_ptr), from, to);
+}
+
+// Frees ptr and returns the path it took, LAT_PATHS if it was ignored
+static unsigned free_path(void* ptr)
+{
+    if(!ptr) return LAT_PATHS; //Invalid pointer
+
+    Slab *slab = slab_of(ptr);
+    HeapRegion *region = NULL;
+    if(!slab && !(region = region_of(ptr)))
+    {
+        Block *large = large_of(ptr);
+        if(!large) return LAT_PATHS; //Not a pointer we handed out
+        large_free(large);
+        return LAT_FREE_MMAP;
+    }
+
+    Block *block_ptr = slab ? NULL : get_block_ptr(ptr);
+    size_t usable;
+
+    if(slab) usable = slab->obj_size;
+    else if(block_ptr->magic == ALLOC_MAGIC && !(block_ptr->size & (BLOCK_MMAP | BLOCK_FREE))) usable = block_size(block_ptr);
+    else usable = SIZE_MAX;
+
+    if(usable <= TCACHE_MAX_SIZE && !tcache.shutdown && !best_fit) // Nothing goes in under best fit, so nothing comes out
+    {
+        size_t idx = usable / ALIGNMENT;
+        if(tcache_contains(&tcache, idx, ptr)) return LAT_PATHS; // Double free
+        if(!tcache.registered) tcache_register();
+        if(tcache.counts[idx] >= TCACHE_BIN_CAP) tcache_flush(&tcache, idx, TCACHE_BATCH);
+        tcache_push(&tcache, idx, ptr);
+        stats_cached(tcache.stats.frees, usable, &tcache.stats.freed_bytes);
+        return LAT_FREE_CACHE;
+    }
+
+    if(slab)
+    {
+        Arena *arena = &arenas[slab->arena];
+        pthread_mutex_lock(&arena->lock);
+        slab_free(arena, slab, ptr);
+        pthread_mutex_unlock(&arena->lock);
+        stats_free(usable, false);
+        return LAT_FREE_SLAB;
+    }
+
+    // Live large blocks were found in the registry above, so a mapped header here is stale or forged
+    if((block_ptr->magic != ALLOC_MAGIC && block_ptr->magic != FREED_MAGIC) || block_ptr->arena != region->arena || (block_ptr->size & BLOCK_MMAP)) return LAT_PATHS;
+
+    // Blocks always go back to the arena that carved them, whichever thread frees them
+    Arena *arena = &arenas[region->arena];
+    pthread_mutex_lock(&arena->lock);
+    if(validate_level >= 3) validate_heap(arena); // Validate the heap before freeing
+
+    if(block_ptr->magic != ALLOC_MAGIC || block_is_free(block_ptr) || (validate_level && !check_block(block_ptr, false))) 
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return LAT_PATHS;
+    }
+
+    release_block(arena, block_ptr);
+
+    maybe_validate_heap(arena);
+    pthread_mutex_unlock(&arena->lock);
+    stats_free(usable, false);
+    return LAT_FREE_HEAP;
+}
+
+// Debug cross-check of a sized free against what the page map and header say. Slab
+// slots are exactly their class, heap blocks may keep a tail too small to split off.
+static bool sized_free_matches(void *ptr, size_t actual)
+{
+    Slab *slab = slab_of(ptr);
+    Block *block = slab ? NULL : region_of(ptr) ? get_block_ptr(ptr) : large_of(ptr);
+    size_t usable = slab ? slab->obj_size : block ? block_size(block) : 0;
+
+    if(slab ? usable == actual : block && usable >= actual && usable - actual < MIN_BLOCK_SIZE) return true;
+    fprintf(stderr, "Sized free of %p with %zu bytes, the chunk holds %zu\n", ptr, actual, usable);
+    assert(0);
+    return false;
+}
+
+// my_free for a caller that knows the size it asked for. A thread cache size picks
+// its bin directly, without the page map lookups that tell a slab slot, a heap block
+// and a mapping apart. A slab size is a slot of exactly its class: malloc and calloc
+// serve these sizes from slabs, and realloc moves any chunk whose new size falls in a
+// different slab class. Larger thread cache sizes come only from the heap, whose
+// header holds the exact size.
+static unsigned free_sized_path(void *ptr, size_t size)
+{
+    if(!ptr || !size || size > TCACHE_MAX_SIZE || tcache.shutdown || best_fit) return free_path(ptr);
+
+    size_t usable = size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : ALIGN(size);
+    if(validate_level >= 2 && !sized_free_matches(ptr, usable)) return free_path(ptr);
+    if(usable > slab_cutoff)
+    {
+        Block *block = get_block_ptr(ptr);
+        if(block->magic != ALLOC_MAGIC || (block->size & (BLOCK_MMAP | BLOCK_FREE)) || block_size(block) > TCACHE_MAX_SIZE) return free_path(ptr);
+        usable = block_size(block);
+    }
+    //Profile samples and huge-aligned blocks can be small mappings, the header tells
+    //whether a lookup is needed
+    else if(__atomic_load_n(&small_mapped, __ATOMIC_RELAXED) && (get_block_ptr(ptr)->size & BLOCK_MMAP) && large_of(ptr)) return free_path(ptr);
+
+    size_t idx = usable / ALIGNMENT;
+    if(tcache_contains(&tcache, idx, ptr)) return LAT_PATHS; // Double free
+    if(!tcache.registered) tcache_register();
+    if(tcache.counts[idx] >= TCACHE_BIN_CAP) tcache_flush(&tcache, idx, TCACHE_BATCH);
+    tcache_push(&tcache, idx, ptr);
+    stats_cached(tcache.stats.frees, usable, &tcache.stats.freed_bytes);
+    return LAT_FREE_CACHE;
+}
+
+// Size 0 means unknown
+__attribute__((noinline)) static void free_hooked(void *ptr, size_t size, unsigned active)
+{
+    if((active & HOOK_TRACE) && ptr && !tcache.trace_nested) trace_record(MY_TRACE_FREE, ptr, size, 0);
+    uint64_t start = active & HOOK_LATENCY ? cycles() : 0;
+    unsigned path = size ? free_sized_path(ptr, size) : free_path(ptr);
+    if(active & HOOK_LATENCY) latency_record(path, cycles() - start);
+}
+
+void my_free(void* ptr)
+{
+    unsigned active = __atomic_load_n(&hooks, __ATOMIC_RELAXED);
+    if(!active) free_path(ptr);
+    else free_hooked(ptr, 0, active);
+}
+
+void my_free_sized(void *ptr, size_t size)
+{
+    unsigned active = __atomic_load_n(&hooks, __ATOMIC_RELAXED);
+    if(!active) free_sized_path(ptr, size);
+    else free_hooked(ptr, size, active);
+}
+
+
+// Resizes a used heap block without moving it, by splitting off its tail or by
+// absorbing the free block right after it. Returns false if the block has to move.
+static bool resize_in_place(Block *block, size_t size)
+{
+    Arena *arena = &arenas[block->arena];
+    bool done = false;
+
+    pthread_mutex_lock(&arena->lock);
+    if(validate_level && !check_block(block, false))
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return false;
+    }
+
+    block->size &= ~BLOCK_ZERO; // Holds live data, so neither it nor a split tail is zero
+    size_t old_size = block_size(block);
+
+    Block *next = next_block(block);
+    size_t joined = block_size(block) + sizeof(Block) + block_size(next);
+    if(size > block_size(block) && block_is_free(next) && joined >= size)
+    {
+        bin_remove(arena, next);
+        block->size = joined | (block->size & BLOCK_FLAGS);
+        next_block(block)->size &= ~BLOCK_PREV_FREE;
+    }
+
+    if(size <= block_size(block))
+    {
+        split(arena, block, size);
+        done = true;
+    }
+    size_t new_size = block_size(block);
+    maybe_validate_heap(arena);
+    pthread_mutex_unlock(&arena->lock);
+    if(done) stats_resize(old_size, new_size);
+    return done;
+}
+
+static void *realloc_path(void *ptr, size_t size, unsigned *path)
+{
+    *path = LAT_PATHS; // Plain mallocs and frees are timed on their own
+    if (!ptr) return my_malloc(size);
+    if (!size)
+    { 
+        my_free(ptr); 
+        return NULL; 
+    }
+    if (size > SIZE_MAX - sizeof(Block) - sizeof(Footer)) return NULL;
+
+    Slab *slab = slab_of(ptr);
+    Block *block = slab ? NULL : get_block_ptr(ptr);
+    bool in_place = false;
+
+    //Chunks of slab sizes always sit in a slot of exactly their class, so a resize that
+    //changes the class moves. my_free_sized relies on it to pick the bin from the size.
+    size_t cls = slab_class(ALIGN(size));
+    if (slab) in_place = cls == slab->obj_size / ALIGNMENT;
+    else if (cls * ALIGNMENT <= slab_cutoff) in_place = false;
+    else if (!(block->size & BLOCK_MMAP))
+    {
+        size_t wanted = ALIGN(size) < ALIGN(MIN_PAYLOAD) ? ALIGN(MIN_PAYLOAD) : ALIGN(size);
+        in_place = resize_in_place(block, wanted);
+    }
+    else if (IS_MMAP(ALIGN(size)) && !(pagemap_get(block) & PAGEMAP_SAMPLED)) // Sampled ones move so the profile follows
+    {
+        //Mapped blocks that stay large get remapped, ones that shrink below the threshold move to the heap
+        void *remapped = large_realloc(block, ALIGN(size));
+        if (remapped)
+        {
+            *path = LAT_REALLOC_REMAP;
+            __atomic_add_fetch(&realloc_remapped, 1, __ATOMIC_RELAXED);
+            return remapped;
+        }
+    }
+    if (in_place)
+    {
+        *path = LAT_REALLOC_IN_PLACE;
+        __atomic_add_fetch(&realloc_in_place, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    size_t old_size = slab ? slab->obj_size : block_size(block);
+
+    void *new_ptr = my_malloc(size);
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    my_free(ptr);
+    __atomic_add_fetch(&realloc_moved, 1, __ATOMIC_RELAXED);
+    *path = LAT_REALLOC_MOVE;
+    return new_ptr;
+}
+
+void *my_realloc(void *ptr, size_t size)
+{
+    unsigned path;
+    unsigned active = __atomic_load_n(&hooks, __ATOMIC_RELAXED);
+    if(!(active & (HOOK_LATENCY | HOOK_TRACE))) return realloc_path(ptr, size, &path);
+
+    bool traced = trace_enter();
+    uint64_t start = active & HOOK_LATENCY ? cycles() : 0;
+    void *new_ptr = realloc_path(ptr, size, &path);
+    if(active & HOOK_LATENCY) latency_record(path, cycles() - start);
+    if(traced) trace_leave(MY_TRACE_REALLOC, new_ptr, size, (uintptr_t)ptr);
+    return new_ptr;
+}
+
+
+
+size_t my_malloc_usable_size(void *ptr)
+{
+    if(!ptr) return 0;
+
+    Slab *slab = slab_of(ptr);
+    if(slab) return slab->obj_size;
+
+    Block *block = region_of(ptr) ? get_block_ptr(ptr) : large_of(ptr);
+    if(!block || block->magic != ALLOC_MAGIC || block_is_free(block)) return 0;
+    return block_size(block);
+}
+
+int my_malloc_trim(size_t pad)
+{
+    size_t released = 0;
+
+    // Blocks parked in this thread's cache cannot be trimmed, other threads keep theirs
+    if(!tcache.shutdown)
+    {
+        for(size_t idx = 0; idx < TCACHE_BINS; idx++) tcache_flush(&tcache, idx, tcache.counts[idx]);
+    }
+
+    for(unsigned i = 0; i < MAX_ARENAS; i++)
+    {
+        Arena *arena = &arenas[i];
+        if(!__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE)) continue;
+
+        pthread_mutex_lock(&arena->lock);
+        arena->trim_pad = TRIM_PAD; // Asked for memory back, the churn has to prove itself again
+        arena->top_trimmed = false;
+        HeapRegion *next;
+        for(HeapRegion *region = arena->regions; region; region = next)
+        {
+            next = region->next;
+            Block *first = region_first_block(region);
+            if(region != arena->top && block_is_free(first) && next_block(first) == region_fencepost(region))
+            {
+                released += region_release(arena, region);
+                continue;
+            }
+
+            released += region_trim(arena, region, region == arena->top ? pad : 0);
+            for(Block *block = first; block_size(block); block = next_block(block))
+            {
+                if(block_is_free(block)) released += purge_pages(block, (char*)block, (char*)next_block(block));
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    released += mapcache_flush();
+    return released > 0;
+}
+
+void my_heap_info(MyHeapInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+
+    for(unsigned i = 0; i < MAX_ARENAS; i++)
+    {
+        Arena *arena = &arenas[i];
+        if(!__atomic_load_n(&arena->initialized, __ATOMIC_ACQUIRE)) continue;
+
+        pthread_mutex_lock(&arena->lock);
+        info->reserved += arena->slab_count * SLAB_SIZE;
+        info->committed += arena->slab_count * SLAB_SIZE;
+        for(HeapRegion *region = arena->regions; region; region = region->next)
+        {
+            info->reserved += region->reserved;
+            info->committed += region->size;
+        }
+        for(size_t idx = next_nonempty_bin(arena, 0); idx < NUM_BINS; idx = next_nonempty_bin(arena, idx + 1))
+        {
+            for(Block *block = arena->bins[idx]; block; block = free_links(block)->next_free)
+            {
+                info->free_bytes += sizeof(Block) + block_size(block);
+                if(block_size(block) > info->largest_free) info->largest_free = block_size(block);
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    size_t mapped = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&mapcache_bytes, __ATOMIC_RELAXED);
+    info->reserved += mapped;
+    info->committed += mapped;
+}
+
+// AnonHugePages of the whole process, or 0 where the kernel does not report it
+static size_t process_thp_bytes(void)
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0;
+
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// Function to print memory statistics
+void my_mallinfo(MyMallinfo *info)
+{
+    ThreadStats sum;
+    size_t *total = (size_t*)&sum;
+
+    pthread_mutex_lock(&stats_lock);
+    for(size_t i = 0; i < STAT_WORDS; i++) total[i] = __atomic_load_n(&((size_t*)&retired_stats)[i], __ATOMIC_RELAXED);
+    for(ThreadStats *stats = stats_threads; stats; stats = stats->next)
+    {
+        for(size_t i = 0; i < STAT_WORDS; i++) total[i] += __atomic_load_n(&((size_t*)stats)[i], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    memset(info, 0, sizeof(*info));
+    for(size_t cls = 0; cls < MY_STAT_CLASSES; cls++)
+    {
+        info->allocs[cls] = sum.allocs[cls];
+        info->frees[cls] = sum.frees[cls];
+        info->heap_allocs += sum.allocs[cls];
+        info->heap_frees += sum.frees[cls];
+    }
+    info->mmap_allocs = sum.mmap_allocs;
+    info->mmap_frees = sum.mmap_frees;
+    info->heap_allocs -= sum.mmap_allocs;
+    info->heap_frees -= sum.mmap_frees;
+    //Counters of different threads are read at slightly different moments
+    info->allocated = sum.allocated_bytes > sum.freed_bytes ? sum.allocated_bytes - sum.freed_bytes : 0;
+
+    info->mapped = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+    info->mapcache = __atomic_load_n(&mapcache_bytes, __ATOMIC_RELAXED);
+    size_t slabs = __atomic_load_n(&slab_mapped, __ATOMIC_RELAXED);
+    info->reserved = __atomic_load_n(&heap_reserved, __ATOMIC_RELAXED) + slabs + info->mapped + info->mapcache;
+    info->committed = __atomic_load_n(&heap_committed, __ATOMIC_RELAXED) + slabs + info->mapped + info->mapcache;
+    info->trimmed = __atomic_load_n(&trimmed_bytes, __ATOMIC_RELAXED);
+    info->purged = __atomic_load_n(&purged_bytes, __ATOMIC_RELAXED);
+}
+
+// Built from the counters alone, so it is safe to call while other threads allocate
+void print_memory_stats() {
+    MyMallinfo info;
+    my_mallinfo(&info);
+
     printf("Memory Stats:\n");
-    printf("Total reserved: %zu bytes\n", total);
-    printf("Used payload: %zu bytes\n", used_payload);
-    printf("Used total (with overhead): %zu bytes\n", used_total);
-    printf("Blocks: %zu (%zu mmap)\n", blocks, mmap_blocks);
+    printf("Total reserved: %zu bytes (%zu committed)\n", info.reserved, info.committed);
+    printf("Allocated: %zu bytes in %zu blocks\n", info.allocated, info.heap_allocs + info.mmap_allocs - info.heap_frees - info.mmap_frees);
+    printf("Heap: %zu bytes in %zu segments, %zu allocations, %zu frees\n", __atomic_load_n(&heap_committed, __ATOMIC_RELAXED), __atomic_load_n(&heap_reserved, __ATOMIC_RELAXED) / SEGMENT_SIZE, info.heap_allocs, info.heap_frees);
+    printf("Large objects: %zu (%zu bytes mapped, threshold %zu), %zu allocations, %zu frees\n", __atomic_load_n(&mmap_blocks, __ATOMIC_RELAXED), info.mapped, __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED), info.mmap_allocs, info.mmap_frees);
+    printf("Mapping cache: %zu bytes, %zu reused\n", info.mapcache, __atomic_load_n(&mapcache_hits, __ATOMIC_RELAXED));
+    printf("Slabs: %zu\n", __atomic_load_n(&slab_mapped, __ATOMIC_RELAXED) / SLAB_SIZE);
+
+    printf("Returned to the kernel: %zu bytes trimmed, %zu bytes purged (%s)\n", info.trimmed, info.purged, background ? "background" : "on free");
+    printf("Huge pages: %zu bytes explicit, %zu bytes advised, %zu bytes transparent in the process\n", __atomic_load_n(&huge_explicit_bytes, __ATOMIC_RELAXED), __atomic_load_n(&huge_advised_bytes, __ATOMIC_RELAXED), process_thp_bytes());
+
+    size_t kept = __atomic_load_n(&realloc_in_place, __ATOMIC_RELAXED);
+    size_t remapped = __atomic_load_n(&realloc_remapped, __ATOMIC_RELAXED);
+    size_t moved = __atomic_load_n(&realloc_moved, __ATOMIC_RELAXED);
+    size_t reallocs = kept + remapped + moved;
+    printf("Reallocs: %zu in place, %zu remapped, %zu moved (%.1f%% without copying)\n", kept, remapped, moved, reallocs ? 100.0 * (kept + remapped) / reallocs : 0.0);
 }
\ No newline at end of file
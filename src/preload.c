@@ -0,0 +1,213 @@
+// Interposes the C allocation API on top of my_allocator, for use as
+//   LD_PRELOAD=./libmallocator.so program
+// Only the entry points below are exported from the shared library.
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "my_allocator.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+// The allocator calls into libc while it sets itself up (pthread_once, pthread_create
+// for the decay thread, pthread_atfork), and libc may call malloc from there. Such
+// nested calls are served from a static bump buffer instead of re-entering the
+// allocator. Bootstrap chunks are never reused, free ignores them.
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+typedef struct BootstrapChunk {
+    size_t size;
+    size_t pad; // Keeps the payload ALIGNMENT-aligned
+} BootstrapChunk;
+
+static _Alignas(ALIGNMENT) char bootstrap[BOOTSTRAP_SIZE];
+static size_t bootstrap_used;
+static __thread unsigned depth __attribute__((tls_model("initial-exec")));
+
+static bool is_bootstrap(const void *ptr)
+{
+    return (const char*)ptr >= bootstrap && (const char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void *bootstrap_alloc(size_t size, size_t alignment)
+{
+    if(size > BOOTSTRAP_SIZE || alignment > BOOTSTRAP_SIZE) return NULL;
+    size_t pow2 = ALIGNMENT;
+    while(pow2 < alignment) pow2 <<= 1;
+    alignment = pow2;
+
+    size_t need = ALIGN(size) + sizeof(BootstrapChunk) + alignment - ALIGNMENT;
+    size_t start = __atomic_fetch_add(&bootstrap_used, need, __ATOMIC_RELAXED);
+    if(start + need > BOOTSTRAP_SIZE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t payload = (uintptr_t)(bootstrap + start + sizeof(BootstrapChunk));
+    payload = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ((BootstrapChunk*)payload - 1)->size = size;
+    return (void*)payload; // The buffer is static, so it is still zero
+}
+
+static size_t bootstrap_size(const void *ptr)
+{
+    return ((const BootstrapChunk*)ptr - 1)->size;
+}
+
+static void *set_errno(void *ptr)
+{
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+// malloc(0) and friends must hand out a unique pointer, the allocator returns NULL
+EXPORT void *malloc(size_t size)
+{
+    if(depth) return bootstrap_alloc(size, ALIGNMENT);
+
+    depth++;
+    void *ptr = my_malloc(size ? size : 1);
+    depth--;
+    return set_errno(ptr);
+}
+
+EXPORT void free(void *ptr)
+{
+    if(!ptr || is_bootstrap(ptr)) return;
+
+    //Freeing can reach libc too (thread registration, trace flushes, validation reports)
+    depth++;
+    my_free(ptr);
+    depth--;
+}
+
+// C23 sized frees, the alignment adds nothing the header does not know
+EXPORT void free_sized(void *ptr, size_t size)
+{
+    if(!ptr || is_bootstrap(ptr)) return;
+
+    depth++;
+    my_free_sized(ptr, size);
+    depth--;
+}
+
+EXPORT void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    (void)alignment;
+    (void)size;
+    free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    if(size && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(depth) return bootstrap_alloc(nmemb * size, ALIGNMENT);
+
+    depth++;
+    void *ptr = nmemb && size ? my_calloc(nmemb, size) : my_malloc(1);
+    depth--;
+    return set_errno(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if(!ptr) return malloc(size);
+    if(is_bootstrap(ptr))
+    {
+        //Moves out of the bootstrap buffer, the old chunk is simply abandoned
+        void *moved = malloc(size);
+        if(moved) memcpy(moved, ptr, size < bootstrap_size(ptr) ? size : bootstrap_size(ptr));
+        return moved;
+    }
+    if(depth) return NULL; // Resizing a real block needs the allocator itself
+
+    depth++;
+    void *resized = my_realloc(ptr, size);
+    depth--;
+    return size ? set_errno(resized) : resized;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if(size && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*)) return EINVAL;
+    if(depth)
+    {
+        void *ptr = bootstrap_alloc(size, alignment);
+        if(!ptr) return ENOMEM;
+        *memptr = ptr;
+        return 0;
+    }
+
+    depth++;
+    int ret = my_posix_memalign(memptr, alignment, size ? size : 1);
+    depth--;
+    return ret;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if(!alignment || (alignment & (alignment - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(depth) return bootstrap_alloc(size, alignment);
+
+    depth++;
+    void *ptr = my_aligned_alloc(alignment, size ? size : 1);
+    depth--;
+    return set_errno(ptr);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if(depth) return bootstrap_alloc(size, alignment);
+
+    depth++;
+    void *ptr = my_memalign(alignment, size ? size : 1);
+    depth--;
+    return set_errno(ptr);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if(size > SIZE_MAX - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    if(ptr && is_bootstrap(ptr)) return bootstrap_size(ptr);
+    return my_malloc_usable_size(ptr);
+}
+
+EXPORT int malloc_trim(size_t pad)
+{
+    return my_malloc_trim(pad);
+}
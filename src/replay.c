@@ -0,0 +1,266 @@
+// Replays an allocation trace recorded with my_trace_start() or MALLOCATOR_TRACE
+// against my_malloc/my_calloc/my_realloc/my_aligned_alloc/my_free, in the order the
+// events were timestamped, on a single thread so every run does the same thing.
+// Usage: ./tracereplay <trace> [touch]
+// With touch set to 1 every allocation is written to like a caller would, so the peak
+// RSS means something; without it the run times the allocator alone.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "my_allocator.h"
+
+// Recorded address -> replayed object, open addressing with linear probing
+typedef struct Slot {
+    uint64_t key; // 0 when empty
+    void *ptr;
+    size_t size;
+} Slot;
+
+static Slot *table;
+static size_t table_mask;
+static size_t table_count;
+
+static MyTraceEvent *events;
+static size_t nevents;
+
+static size_t slot_of(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return (size_t)key & table_mask;
+}
+
+static Slot *table_find(uint64_t key)
+{
+    for(size_t i = slot_of(key);; i = (i + 1) & table_mask)
+    {
+        if(table[i].key == key) return &table[i];
+        if(!table[i].key) return NULL;
+    }
+}
+
+static void table_insert(uint64_t key, void *ptr, size_t size)
+{
+    size_t i = slot_of(key);
+    while(table[i].key) i = (i + 1) & table_mask;
+    table[i] = (Slot){ key, ptr, size };
+    table_count++;
+}
+
+// Backward-shift deletion, so lookups never need tombstones
+static void table_remove(Slot *slot)
+{
+    size_t hole = (size_t)(slot - table);
+    for(size_t i = (hole + 1) & table_mask; table[i].key; i = (i + 1) & table_mask)
+    {
+        size_t home = slot_of(table[i].key);
+        if(((i - home) & table_mask) >= ((i - hole) & table_mask))
+        {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole].key = 0;
+    table_count--;
+}
+
+// Stable merge sort by time. Threads flush their events in chunks, the timestamps put
+// them back in order, and events of one thread with equal stamps keep file order.
+static void sort_by_time(void)
+{
+    MyTraceEvent *from = events, *to = malloc(nevents * sizeof(MyTraceEvent));
+    if(!to)
+    {
+        fprintf(stderr, "out of memory for sorting the trace\n");
+        exit(1);
+    }
+
+    for(size_t width = 1; width < nevents; width *= 2)
+    {
+        for(size_t lo = 0; lo < nevents; lo += 2 * width)
+        {
+            size_t mid = lo + width < nevents ? lo + width : nevents;
+            size_t hi = lo + 2 * width < nevents ? lo + 2 * width : nevents;
+            size_t a = lo, b = mid, out = lo;
+            while(a < mid && b < hi) to[out++] = from[b].time < from[a].time ? from[b++] : from[a++];
+            while(a < mid) to[out++] = from[a++];
+            while(b < hi) to[out++] = from[b++];
+        }
+        MyTraceEvent *swap = from;
+        from = to;
+        to = swap;
+    }
+    if(from != events) memcpy(events, from, nevents * sizeof(MyTraceEvent));
+    free(from == events ? to : from);
+}
+
+static bool load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+    {
+        perror(path);
+        return false;
+    }
+
+    MyTraceHeader header;
+    if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, MY_TRACE_MAGIC, sizeof(header.magic)) ||
+       header.version != MY_TRACE_VERSION || header.event_size != sizeof(MyTraceEvent))
+    {
+        fprintf(stderr, "%s: not a version %d allocation trace\n", path, MY_TRACE_VERSION);
+        fclose(f);
+        return false;
+    }
+
+    size_t capacity = 0;
+    for(;;)
+    {
+        if(nevents == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 65536;
+            events = realloc(events, capacity * sizeof(MyTraceEvent));
+            if(!events)
+            {
+                fprintf(stderr, "out of memory for the trace\n");
+                exit(1);
+            }
+        }
+        size_t want = capacity - nevents;
+        size_t n = fread(events + nevents, sizeof(MyTraceEvent), want, f);
+        nevents += n;
+        if(n < want) break;
+    }
+    fclose(f);
+    sort_by_time();
+    return true;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace> [touch]\n", argv[0]);
+        return 2;
+    }
+    bool touch = argc > 2 && atoi(argv[2]);
+    if(!load(argv[1])) return 1;
+
+    size_t capacity = 1024;
+    while(capacity < 2 * nevents) capacity *= 2;
+    table = calloc(capacity, sizeof(Slot));
+    if(!table)
+    {
+        fprintf(stderr, "out of memory for the address table\n");
+        return 1;
+    }
+    table_mask = capacity - 1;
+
+    size_t ops[MY_TRACE_FREE + 1] = {0};
+    size_t unknown = 0, reused = 0, failed = 0;
+    size_t live = 0, peak_live = 0;
+    uint32_t threads = 0;
+
+    double start = now_seconds();
+    for(size_t i = 0; i < nevents; i++)
+    {
+        MyTraceEvent *e = &events[i];
+        if(e->op > MY_TRACE_FREE) continue;
+        ops[e->op]++;
+        if(e->thread > threads) threads = e->thread;
+
+        Slot *old = NULL;
+        if(e->op == MY_TRACE_FREE || (e->op == MY_TRACE_REALLOC && e->arg))
+        {
+            old = table_find(e->op == MY_TRACE_FREE ? e->ptr : e->arg);
+            if(!old)
+            {
+                //Allocated before the trace started, or by a call that raced with the start
+                unknown++;
+                continue;
+            }
+        }
+        if(e->op == MY_TRACE_FREE)
+        {
+            live -= old->size;
+            if(e->size) my_free_sized(old->ptr, e->size);
+            else my_free(old->ptr);
+            table_remove(old);
+            continue;
+        }
+        //A failed allocation left the program's heap as it was
+        if(!e->ptr && !(e->op == MY_TRACE_REALLOC && !e->size)) continue;
+
+        void *ptr = NULL;
+        size_t size = e->size;
+        switch(e->op)
+        {
+            case MY_TRACE_MALLOC: ptr = my_malloc(size); break;
+            case MY_TRACE_CALLOC: ptr = my_calloc(e->arg, size); size *= e->arg; break;
+            case MY_TRACE_ALIGNED: ptr = my_aligned_alloc(e->arg, size); break;
+            case MY_TRACE_REALLOC:
+                ptr = my_realloc(old ? old->ptr : NULL, size);
+                if(old && (ptr || !size))
+                {
+                    live -= old->size;
+                    table_remove(old);
+                }
+                break;
+        }
+        if(!e->ptr) continue; // realloc to 0 bytes, a free in disguise
+        if(!ptr)
+        {
+            failed++;
+            continue;
+        }
+        if(touch) memset(ptr, 0xa5, size);
+
+        //Events stamped microseconds apart on different threads can still come out of
+        //order, then an address is handed out again before its free was replayed
+        Slot *stale = table_find(e->ptr);
+        if(stale)
+        {
+            reused++;
+            live -= stale->size;
+            my_free(stale->ptr);
+            table_remove(stale);
+        }
+        table_insert(e->ptr, ptr, size);
+        live += size;
+        if(live > peak_live) peak_live = live;
+    }
+    double elapsed = now_seconds() - start;
+
+    MyMallinfo info;
+    my_mallinfo(&info);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("events        %zu from %u threads\n", nevents, threads);
+    printf("malloc        %zu\ncalloc        %zu\nrealloc       %zu\naligned       %zu\nfree          %zu\n",
+           ops[MY_TRACE_MALLOC], ops[MY_TRACE_CALLOC], ops[MY_TRACE_REALLOC], ops[MY_TRACE_ALIGNED], ops[MY_TRACE_FREE]);
+    printf("time          %.3f s, %.1f ns per event, %.2f Mops/s\n", elapsed, nevents ? elapsed * 1e9 / (double)nevents : 0.0,
+           elapsed > 0 ? (double)nevents / elapsed / 1e6 : 0.0);
+    printf("live at end   %zu objects, %.1f MB\n", table_count, live / 1048576.0);
+    printf("peak live     %.1f MB\n", peak_live / 1048576.0);
+    printf("reserved      %.1f MB, committed %.1f MB\n", info.reserved / 1048576.0, info.committed / 1048576.0);
+    printf("peak RSS      %.1f MB (trace and address table included)\n", usage.ru_maxrss / 1024.0);
+    if(unknown) printf("skipped       %zu frees or reallocs of addresses the trace never handed out\n", unknown);
+    if(reused) printf("reordered     %zu addresses reused before their free, freed early\n", reused);
+    if(failed) printf("failed        %zu allocations that succeeded when recorded\n", failed);
+
+    free(table);
+    free(events);
+    return 0;
+}